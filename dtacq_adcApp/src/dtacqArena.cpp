@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "dtacqArena.h"
+
+/* Size that huge page mappings are rounded up to; 2 MB on x86-64 */
+static const size_t hugePageSize = 2 * 1024 * 1024;
+
+void dtacqArena::threadFaults(long *minor, long *major)
+{
+    struct rusage usage;
+#ifdef RUSAGE_THREAD
+    int who = RUSAGE_THREAD;
+#else
+    int who = RUSAGE_SELF;
+#endif
+    if (getrusage(who, &usage) != 0) {
+        *minor = *major = 0;
+        return;
+    }
+    *minor = usage.ru_minflt;
+    *major = usage.ru_majflt;
+}
+
+dtacqArena::dtacqArena(size_t size, asynUser *pasynUser)
+    : pBase(NULL), length(0), huge(0), isLocked(false), minorFaults(0), majorFaults(0)
+{
+    if (size == 0) return;
+    long minorBefore, majorBefore;
+    threadFaults(&minorBefore, &majorBefore);
+    size_t rounded = (size + hugePageSize - 1) & ~(hugePageSize - 1);
+    void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    p = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) this->huge = 2;
+#endif
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            asynPrint(pasynUser, ASYN_TRACE_ERROR, "dtacqArena: unable to map %lu bytes: %s\n",
+                      (unsigned long)rounded, strerror(errno));
+            return;
+        }
+#ifdef MADV_HUGEPAGE
+        if (madvise(p, rounded, MADV_HUGEPAGE) == 0) this->huge = 1;
+#endif
+    }
+    this->pBase = p;
+    this->length = rounded;
+    /* Touch every page now rather than on the first frame */
+    memset(this->pBase, 0, this->length);
+    if (mlock(this->pBase, this->length) == 0)
+        this->isLocked = true;
+    else
+        asynPrint(pasynUser, ASYN_TRACE_ERROR,
+                  "dtacqArena: unable to lock %lu bytes (check RLIMIT_MEMLOCK): %s\n",
+                  (unsigned long)this->length, strerror(errno));
+    long minorAfter, majorAfter;
+    threadFaults(&minorAfter, &majorAfter);
+    this->minorFaults = minorAfter - minorBefore;
+    this->majorFaults = majorAfter - majorBefore;
+}
+
+dtacqArena::~dtacqArena()
+{
+    if (!this->pBase) return;
+    if (this->isLocked) munlock(this->pBase, this->length);
+    munmap(this->pBase, this->length);
+}
+
+void dtacqArena::report(FILE *fp) const
+{
+    static const char *pageNames[] = {"normal pages", "transparent huge pages", "huge pages"};
+    if (!this->pBase) {
+        fprintf(fp, "  Raw frame arena:   not allocated\n");
+        return;
+    }
+    fprintf(fp, "  Raw frame arena:   %.1f MB, %s, %s, %ld minor / %ld major faults to prefault\n",
+            this->length / 1048576.0, pageNames[this->huge],
+            this->isLocked ? "locked" : "NOT locked", this->minorFaults, this->majorFaults);
+}
@@ -0,0 +1,40 @@
+#ifndef DTACQARENA_H
+#define DTACQARENA_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <asynDriver.h>
+
+/* A block of memory for raw frames that is mapped once, at startup, and never paged.
+   Huge pages are used when the system has them reserved (hugetlbfs), otherwise
+   transparent huge pages are requested. The whole block is written once (prefaulted)
+   and locked, so the receive path takes no page faults once acquisition is running. */
+class dtacqArena {
+public:
+    /* Errors are reported through pasynUser's trace */
+    dtacqArena(size_t size, asynUser *pasynUser);
+    ~dtacqArena();
+    void *base() const { return this->pBase; }
+    size_t size() const { return this->length; }
+    /* 2 for reserved huge pages, 1 for transparent huge pages requested, 0 for normal pages */
+    int hugePages() const { return this->huge; }
+    bool locked() const { return this->isLocked; }
+    /* Page faults taken while mapping and prefaulting */
+    long prefaultMinor() const { return this->minorFaults; }
+    long prefaultMajor() const { return this->majorFaults; }
+    void report(FILE *fp) const;
+
+    /* Page faults taken so far by the calling thread (by the process where per-thread
+       counts are not available) */
+    static void threadFaults(long *minor, long *major);
+
+private:
+    void *pBase;
+    size_t length;
+    int huge;
+    bool isLocked;
+    long minorFaults, majorFaults;
+};
+
+#endif /* DTACQARENA_H */
@@ -0,0 +1,51 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include <osiSock.h>
+
+#include "dtacqBacklog.h"
+
+int dtacqFindSocket(const char *hostInfo)
+{
+    char address[128];
+    struct sockaddr_in target;
+    /* Drop any protocol suffix, e.g. "host:4210 TCP" */
+    strncpy(address, hostInfo, sizeof(address) - 1);
+    address[sizeof(address) - 1] = '\0';
+    char *pSpace = strchr(address, ' ');
+    if (pSpace) *pSpace = '\0';
+    if (aToIPAddr(address, 0, &target) != 0) return -1;
+
+    long maxFd = sysconf(_SC_OPEN_MAX);
+    if (maxFd < 0 || maxFd > 65536) maxFd = 65536;
+    for (int fd = 0; fd < maxFd; fd++) {
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !S_ISSOCK(info.st_mode)) continue;
+        struct sockaddr_in peer;
+        socklen_t len = sizeof(peer);
+        if (getpeername(fd, (struct sockaddr *)&peer, &len) != 0) continue;
+        if (peer.sin_family == AF_INET &&
+            peer.sin_addr.s_addr == target.sin_addr.s_addr &&
+            peer.sin_port == target.sin_port)
+            return fd;
+    }
+    return -1;
+}
+
+int dtacqSocketQueue(int fd, long *queued, long *bufferSize)
+{
+    int available, size;
+    socklen_t len = sizeof(size);
+    if (ioctl(fd, FIONREAD, &available) != 0) return errno;
+    if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, &len) != 0) return errno;
+    *queued = available;
+    *bufferSize = size;
+    return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef DTACQBACKLOG_H
+#define DTACQBACKLOG_H
+
+/* Access to the kernel's view of the data port connection, used to spot the reader
+   falling behind before the receive buffer (and then the carrier's FIFO) overflows.
+   drvAsynIPPort does not expose its socket, so it is found by its peer address. */
+
+/* Find the descriptor of this process's TCP connection to hostInfo ("host:port", as
+   given to drvAsynIPPortConfigure). Returns -1 if there is no such connection.
+   This checks every open descriptor, so call it once per connection, not per sample */
+int dtacqFindSocket(const char *hostInfo);
+
+/* Bytes waiting to be read on fd and the size of its receive buffer.
+   Returns 0, or an errno value if fd is no longer a usable socket */
+int dtacqSocketQueue(int fd, long *queued, long *bufferSize);
+
+#endif /* DTACQBACKLOG_H */
@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include <epicsThread.h>
+#include <epicsStdio.h>
+#include <asynOctetSyncIO.h>
+
+#include "dtacqCommandQueue.h"
+
+static void queueThreadC(void *drvPvt)
+{
+    dtacqCommandQueue *pQueue = (dtacqCommandQueue *)drvPvt;
+    pQueue->queueThread();
+}
+
+dtacqCommandQueue::dtacqCommandQueue(const char *controlPortName, double timeout, size_t maxReply,
+                                     unsigned int priority, unsigned int stackSize,
+                                     completionFunc callback, void *pvt, asynUser *pasynUser)
+    : pasynUserControl(NULL), pasynUser(pasynUser), timeout(timeout), maxReply(maxReply), callback(callback), pvt(pvt),
+      busy(false)
+{
+    clearTally(&this->total);
+    /* A connection of our own, so the driver's synchronous uses of the port are not disturbed */
+    if (pasynOctetSyncIO->connect(controlPortName, -1, &this->pasynUserControl, NULL) != asynSuccess) {
+        asynPrint(this->pasynUser, ASYN_TRACE_ERROR,
+                  "dtacqCommandQueue: unable to connect to control port %s\n", controlPortName);
+        this->pasynUserControl = NULL;
+    }
+    if (epicsThreadCreate("D-TACQCommand", priority, stackSize,
+                          (EPICSTHREADFUNC)queueThreadC, this) == NULL)
+        asynPrint(this->pasynUser, ASYN_TRACE_ERROR,
+                  "dtacqCommandQueue: epicsThreadCreate failure for command thread\n");
+}
+
+void dtacqCommandQueue::set(const char *site, const char *parameter, const char *value, int tag, int arg)
+{
+    add(DtacqCommandSet, site, parameter, value, tag, arg);
+}
+
+void dtacqCommandQueue::get(const char *site, const char *parameter, int tag, int arg)
+{
+    add(DtacqCommandGet, site, parameter, "", tag, arg);
+}
+
+void dtacqCommandQueue::send(const char *line, int tag, int arg)
+{
+    add(DtacqCommandSend, "", line, "", tag, arg);
+}
+
+void dtacqCommandQueue::call(int tag, int arg)
+{
+    add(DtacqCommandCall, "", "", "", tag, arg);
+}
+
+void dtacqCommandQueue::add(DtacqCommandKind kind, const char *site, const char *parameter, const char *value,
+                            int tag, int arg)
+{
+    this->mutex.lock();
+    /* Only commands that have not been sent yet are in the queue, so they can still be merged.
+       The latest set of a parameter takes the new value, even past gets queued after it: those
+       are readbacks, and now read the value that will be current. A get is only merged with
+       one queued after every set of the same parameter, so it never reads a stale value */
+    if (kind == DtacqCommandSet || kind == DtacqCommandGet) {
+        for (std::deque<DtacqCommand>::reverse_iterator it = this->queue.rbegin();
+             it != this->queue.rend(); ++it) {
+            if (it->site != site || it->parameter != parameter) continue;
+            if (it->kind == DtacqCommandSet) {
+                if (kind == DtacqCommandGet) break;
+                it->value = value;
+            } else if (it->kind != DtacqCommandGet || kind != DtacqCommandGet) {
+                continue;
+            }
+            it->tag = tag;
+            it->arg = arg;
+            this->total.stats.coalesced++;
+            this->perCommand[parameter].stats.coalesced++;
+            this->mutex.unlock();
+            return;
+        }
+    }
+    DtacqCommand command;
+    command.kind = kind;
+    command.site = site;
+    command.parameter = parameter;
+    command.value = value;
+    command.tag = tag;
+    command.arg = arg;
+    command.status = asynSuccess;
+    command.latency = 0;
+    command.roundTrip = 0;
+    epicsTimeGetCurrent(&command.queued);
+    this->queue.push_back(command);
+    this->mutex.unlock();
+    this->wakeup.signal();
+}
+
+int dtacqCommandQueue::pending()
+{
+    this->mutex.lock();
+    int n = (int)this->queue.size() + (this->busy ? 1 : 0);
+    this->mutex.unlock();
+    return n;
+}
+
+void dtacqCommandQueue::clearTally(tally *t)
+{
+    memset(&t->stats, 0, sizeof(t->stats));
+    t->latencySum = 0;
+}
+
+void dtacqCommandQueue::addTally(tally *t, const DtacqCommand *command)
+{
+    t->stats.count++;
+    if (command->status != asynSuccess) t->stats.errors++;
+    t->stats.lastLatency = command->latency;
+    if (command->latency > t->stats.maxLatency) t->stats.maxLatency = command->latency;
+    t->latencySum += command->latency;
+}
+
+void dtacqCommandQueue::readTally(const tally *t, DtacqCommandStats *stats)
+{
+    *stats = t->stats;
+    stats->meanLatency = t->stats.count ? t->latencySum / t->stats.count : 0.0;
+}
+
+void dtacqCommandQueue::getStats(DtacqCommandStats *stats)
+{
+    this->mutex.lock();
+    readTally(&this->total, stats);
+    this->mutex.unlock();
+}
+
+void dtacqCommandQueue::resetStats()
+{
+    this->mutex.lock();
+    clearTally(&this->total);
+    this->perCommand.clear();
+    this->mutex.unlock();
+}
+
+void dtacqCommandQueue::report(FILE *fp)
+{
+    this->mutex.lock();
+    fprintf(fp, "  Control commands: %d pending\n", (int)this->queue.size() + (this->busy ? 1 : 0));
+    fprintf(fp, "    %-20s %8s %8s %8s %10s %10s\n", "command", "count", "merged", "errors", "mean ms", "max ms");
+    for (std::map<std::string, tally>::const_iterator it = this->perCommand.begin();
+         it != this->perCommand.end(); ++it) {
+        DtacqCommandStats stats;
+        readTally(&it->second, &stats);
+        fprintf(fp, "    %-20s %8d %8d %8d %10.3f %10.3f\n", it->first.c_str(), stats.count,
+                stats.coalesced, stats.errors, stats.meanLatency * 1e3, stats.maxLatency * 1e3);
+    }
+    this->mutex.unlock();
+}
+
+/* Perform the I/O for one command, filling in its status and reply */
+void dtacqCommandQueue::execute(DtacqCommand *command)
+{
+    std::string line;
+    if (command->kind == DtacqCommandSet)
+        line = "set.site " + command->site + " " + command->parameter + " " + command->value + "\n";
+    else if (command->kind == DtacqCommandGet)
+        line = "get.site " + command->site + " " + command->parameter + "\n";
+    else if (command->kind == DtacqCommandSend)
+        line = command->parameter + "\n";
+    else
+        return;
+    if (this->pasynUserControl == NULL) {
+        command->status = asynDisconnected;
+        return;
+    }
+    size_t nbytesIn, nbytesOut;
+    int eomReason;
+    if (command->kind == DtacqCommandGet) {
+        std::vector<char> readBuffer(this->maxReply, 0);
+        command->status = pasynOctetSyncIO->writeRead(this->pasynUserControl, line.c_str(), line.size(),
+                                                      &readBuffer[0], readBuffer.size() - 1, this->timeout,
+                                                      &nbytesOut, &nbytesIn, &eomReason);
+        command->reply.assign(&readBuffer[0]);
+    } else {
+        command->status = pasynOctetSyncIO->write(this->pasynUserControl, line.c_str(), line.size(),
+                                                  this->timeout, &nbytesOut);
+    }
+}
+
+void dtacqCommandQueue::queueThread()
+{
+    while (true) {
+        this->mutex.lock();
+        while (this->queue.empty()) {
+            this->mutex.unlock();
+            this->wakeup.wait();
+            this->mutex.lock();
+        }
+        DtacqCommand command = this->queue.front();
+        this->queue.pop_front();
+        this->busy = true;
+        this->mutex.unlock();
+
+        epicsTimeStamp start, end;
+        epicsTimeGetCurrent(&start);
+        execute(&command);
+        epicsTimeGetCurrent(&end);
+        command.roundTrip = epicsTimeDiffInSeconds(&end, &start);
+        command.latency = epicsTimeDiffInSeconds(&end, &command.queued);
+
+        this->mutex.lock();
+        if (command.kind != DtacqCommandCall) {
+            std::string key = command.parameter;
+            if (command.kind == DtacqCommandSend) key = key.substr(0, key.find(' '));
+            addTally(&this->total, &command);
+            addTally(&this->perCommand[key], &command);
+        }
+        this->busy = false;
+        this->mutex.unlock();
+        this->callback(this->pvt, &command);
+    }
+}
@@ -0,0 +1,103 @@
+#ifndef DTACQCOMMANDQUEUE_H
+#define DTACQCOMMANDQUEUE_H
+
+#include <stdio.h>
+#include <deque>
+#include <map>
+#include <string>
+
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsTime.h>
+#include <asynDriver.h>
+
+/* Asynchronous queue of commands for the carrier's control port.
+
+   Commands are sent in order by a thread of the queue's own, on its own connection
+   to the control port, so the caller never waits for the carrier. When a command
+   has completed the completion callback is called on the queue thread with no locks
+   held. Redundant requests are coalesced while they are still queued: a set of a
+   site and parameter that has not been sent yet takes the new value, and a get that
+   is already queued (after any set of the same parameter) is not queued twice.
+   Coalesced requests keep the newest tag and arg and complete once. */
+
+typedef enum {
+    DtacqCommandSet,     /* set.site <site> <parameter> <value> */
+    DtacqCommandGet,     /* get.site <site> <parameter>; the reply is returned */
+    DtacqCommandSend,    /* A raw command line, never coalesced */
+    DtacqCommandCall     /* No I/O: the callback is run in order with the other commands */
+} DtacqCommandKind;
+
+typedef struct DtacqCommand {
+    DtacqCommandKind kind;
+    std::string site;
+    std::string parameter;   /* The command line for DtacqCommandSend */
+    std::string value;
+    int tag;                 /* Chosen by the caller to identify the completion */
+    int arg;
+    asynStatus status;
+    std::string reply;
+    epicsTimeStamp queued;
+    double latency;          /* Seconds from first being queued to completion */
+    double roundTrip;        /* Seconds spent on the control port */
+} DtacqCommand;
+
+typedef struct DtacqCommandStats {
+    int count;
+    int coalesced;
+    int errors;
+    double lastLatency;      /* Seconds */
+    double meanLatency;
+    double maxLatency;
+} DtacqCommandStats;
+
+class dtacqCommandQueue {
+public:
+    typedef void (*completionFunc)(void *pvt, const DtacqCommand *command);
+
+    /* Connects to the asyn octet port controlPortName and starts the queue thread with the
+       given EPICS priority and stack size. Errors are reported through pasynUser's trace */
+    dtacqCommandQueue(const char *controlPortName, double timeout, size_t maxReply,
+                      unsigned int priority, unsigned int stackSize,
+                      completionFunc callback, void *pvt, asynUser *pasynUser);
+    void set(const char *site, const char *parameter, const char *value, int tag, int arg);
+    void get(const char *site, const char *parameter, int tag, int arg);
+    void send(const char *line, int tag, int arg);
+    void call(int tag, int arg);
+    /* Commands queued or in progress */
+    int pending();
+    /* Statistics since the last resetStats() over all commands */
+    void getStats(DtacqCommandStats *stats);
+    void resetStats();
+    /* Per parameter statistics */
+    void report(FILE *fp);
+    void queueThread();
+
+private:
+    void add(DtacqCommandKind kind, const char *site, const char *parameter, const char *value,
+             int tag, int arg);
+    void execute(DtacqCommand *command);
+    asynUser *pasynUserControl;
+    asynUser *pasynUser;
+    double timeout;
+    size_t maxReply;
+    completionFunc callback;
+    void *pvt;
+    epicsMutex mutex;
+    epicsEvent wakeup;
+    std::deque<DtacqCommand> queue;
+    bool busy;
+    struct tally {
+        DtacqCommandStats stats;
+        double latencySum;
+    };
+    void clearTally(tally *t);
+    void addTally(tally *t, const DtacqCommand *command);
+    void readTally(const tally *t, DtacqCommandStats *stats);
+    tally total;
+    /* Keyed by the parameter, or the command word of a raw command */
+    std::map<std::string, tally> perCommand;
+};
+
+#endif /* DTACQCOMMANDQUEUE_H */
@@ -0,0 +1,342 @@
+#include <string.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "dtacqCompress.h"
+
+static const int headerWords = 9;
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void putLE32(uint8_t *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static inline uint32_t getLE32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Transpose an 8x8 bit matrix held with row i in byte i (column j is bit j) */
+static inline uint64_t transpose8x8(uint64_t x)
+{
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x = x ^ t ^ (t << 28);
+    return x;
+}
+
+/* Bitshuffle n elements (n a multiple of 8) of elemSize bytes: bit plane p is written as
+   n/8 consecutive bytes, bit j of byte g holding bit p of element 8g+j. Self-inverse
+   apart from the layout, see bitUnshuffle() */
+static void bitShuffle(const uint8_t *pIn, uint8_t *pOut, size_t n, int elemSize)
+{
+    size_t planeBytes = n / 8;
+    for (size_t g = 0; g < planeBytes; g++) {
+        const uint8_t *pGroup = pIn + g * 8 * elemSize;
+        for (int b = 0; b < elemSize; b++) {
+            uint64_t x = 0;
+            for (int i = 0; i < 8; i++) x |= (uint64_t)pGroup[i * elemSize + b] << (8 * i);
+            x = transpose8x8(x);
+            for (int j = 0; j < 8; j++) pOut[(8 * b + j) * planeBytes + g] = (x >> (8 * j)) & 0xff;
+        }
+    }
+}
+
+static void bitUnshuffle(const uint8_t *pIn, uint8_t *pOut, size_t n, int elemSize)
+{
+    size_t planeBytes = n / 8;
+    for (size_t g = 0; g < planeBytes; g++) {
+        uint8_t *pGroup = pOut + g * 8 * elemSize;
+        for (int b = 0; b < elemSize; b++) {
+            uint64_t x = 0;
+            for (int j = 0; j < 8; j++) x |= (uint64_t)pIn[(8 * b + j) * planeBytes + g] << (8 * j);
+            x = transpose8x8(x);
+            for (int i = 0; i < 8; i++) pGroup[i * elemSize + b] = (x >> (8 * i)) & 0xff;
+        }
+    }
+}
+
+/* Delta and zigzag encode elements [first, first+n) of the frame, per channel along time */
+template <typename epicsType, typename unsignedType>
+static void deltaEncode(const DtacqCodecFrame *frame, size_t first, size_t n, unsignedType *pOut)
+{
+    const epicsType *pIn = (const epicsType *)frame->pData;
+    const int bits = 8 * sizeof(epicsType);
+    size_t row = first / frame->rowWidth;
+    int col = (int)(first % frame->rowWidth);
+    for (size_t k = 0; k < n; k++) {
+        size_t i = row * frame->rowWidth + col;
+        epicsType x = pIn[i];
+        epicsType prev = row ? pIn[i - frame->rowWidth] : 0;
+        if (col < frame->nData) {
+            x = x >> frame->dataShift;
+            prev = prev >> frame->dataShift;
+        }
+        unsignedType d = (unsignedType)x - (unsignedType)prev;
+        pOut[k] = (unsignedType)(d << 1) ^ (unsignedType)((epicsType)d >> (bits - 1));
+        if (++col == frame->rowWidth) {
+            col = 0;
+            row++;
+        }
+    }
+}
+
+int dtacqCodecBlockCount(const DtacqCodecFrame *frame)
+{
+    size_t nElements = (size_t)frame->rowWidth * frame->nRows;
+    return (int)((nElements + DTACQ_CODEC_BLOCK_ELEMENTS - 1) / DTACQ_CODEC_BLOCK_ELEMENTS);
+}
+
+size_t dtacqCodecHeaderSize(int nBlocks)
+{
+    return (headerWords + nBlocks) * 4;
+}
+
+size_t dtacqCodecBlockBound(const DtacqCodecFrame *frame)
+{
+    size_t blockBytes = (size_t)DTACQ_CODEC_BLOCK_ELEMENTS * frame->elemSize;
+    return blockBytes + blockBytes / 255 + 16;
+}
+
+uint32_t dtacqCompressBlock(const DtacqCodecFrame *frame, int block, uint8_t *pDest,
+                            std::vector<uint8_t> *scratch)
+{
+    size_t nElements = (size_t)frame->rowWidth * frame->nRows;
+    size_t first = (size_t)block * DTACQ_CODEC_BLOCK_ELEMENTS;
+    size_t n = nElements - first;
+    if (n > DTACQ_CODEC_BLOCK_ELEMENTS) n = DTACQ_CODEC_BLOCK_ELEMENTS;
+    size_t nBytes = n * frame->elemSize;
+    scratch->resize(2 * (size_t)DTACQ_CODEC_BLOCK_ELEMENTS * frame->elemSize);
+    uint8_t *pDelta = &(*scratch)[0];
+    uint8_t *pShuffled = pDelta + (size_t)DTACQ_CODEC_BLOCK_ELEMENTS * frame->elemSize;
+
+    if (frame->elemSize == 2)
+        deltaEncode<int16_t, uint16_t>(frame, first, n, (uint16_t *)pDelta);
+    else
+        deltaEncode<int32_t, uint32_t>(frame, first, n, (uint32_t *)pDelta);
+    /* Elements left over after the last whole group of 8 are stored as they are */
+    size_t nShuffled = n - n % 8;
+    bitShuffle(pDelta, pShuffled, nShuffled, frame->elemSize);
+    memcpy(pShuffled + nShuffled * frame->elemSize, pDelta + nShuffled * frame->elemSize,
+           (n - nShuffled) * frame->elemSize);
+
+    int compressed = dtacqLz4Compress(pShuffled, (int)nBytes, pDest, (int)nBytes - 1);
+    if (compressed > 0) return (uint32_t)compressed;
+    memcpy(pDest, pShuffled, nBytes);
+    return (uint32_t)nBytes | DTACQ_CODEC_STORED;
+}
+
+void dtacqCodecWriteHeader(const DtacqCodecFrame *frame, const uint32_t *blockSizes, uint8_t *pDest)
+{
+    int nBlocks = dtacqCodecBlockCount(frame);
+    putLE32(pDest + 0,  DTACQ_CODEC_MAGIC);
+    putLE32(pDest + 4,  DTACQ_CODEC_VERSION);
+    putLE32(pDest + 8,  frame->elemSize);
+    putLE32(pDest + 12, frame->rowWidth);
+    putLE32(pDest + 16, frame->nRows);
+    putLE32(pDest + 20, frame->nData);
+    putLE32(pDest + 24, frame->dataShift);
+    putLE32(pDest + 28, DTACQ_CODEC_BLOCK_ELEMENTS);
+    putLE32(pDest + 32, nBlocks);
+    for (int b = 0; b < nBlocks; b++) putLE32(pDest + 4 * (headerWords + b), blockSizes[b]);
+}
+
+/* Undo the zigzag, delta and shift applied by deltaEncode() over the whole frame */
+template <typename epicsType, typename unsignedType>
+static void deltaDecode(unsignedType *pData, size_t nRows, int rowWidth, int nData, int dataShift)
+{
+    for (size_t k = 0; k < nRows * rowWidth; k++)
+        pData[k] = (pData[k] >> 1) ^ (unsignedType)(-(epicsType)(pData[k] & 1));
+    for (size_t r = 1; r < nRows; r++) {
+        unsignedType *pRow = pData + r * rowWidth;
+        for (int c = 0; c < rowWidth; c++) pRow[c] += pRow[c - rowWidth];
+    }
+    for (size_t r = 0; r < nRows; r++) {
+        unsignedType *pRow = pData + r * rowWidth;
+        for (int c = 0; c < nData; c++) pRow[c] = (unsignedType)(pRow[c] << dataShift);
+    }
+}
+
+long dtacqDecompress(const uint8_t *pSrc, size_t srcSize, void *pDest, size_t destSize)
+{
+    if (srcSize < dtacqCodecHeaderSize(0) || getLE32(pSrc) != DTACQ_CODEC_MAGIC ||
+        getLE32(pSrc + 4) != DTACQ_CODEC_VERSION)
+        return -1;
+    int elemSize = getLE32(pSrc + 8);
+    int rowWidth = getLE32(pSrc + 12);
+    size_t nRows = getLE32(pSrc + 16);
+    int nData = getLE32(pSrc + 20);
+    int dataShift = getLE32(pSrc + 24);
+    size_t blockElements = getLE32(pSrc + 28);
+    int nBlocks = getLE32(pSrc + 32);
+    size_t nElements = nRows * rowWidth;
+    if ((elemSize != 2 && elemSize != 4) || blockElements == 0 || blockElements % 8 ||
+        nElements * elemSize > destSize || srcSize < dtacqCodecHeaderSize(nBlocks) ||
+        (size_t)nBlocks != (nElements + blockElements - 1) / blockElements)
+        return -1;
+
+    std::vector<uint8_t> shuffled(blockElements * elemSize);
+    const uint8_t *pBlock = pSrc + dtacqCodecHeaderSize(nBlocks);
+    const uint8_t *pEnd = pSrc + srcSize;
+    uint8_t *pOut = (uint8_t *)pDest;
+    for (int b = 0; b < nBlocks; b++) {
+        uint32_t entry = getLE32(pSrc + 4 * (headerWords + b));
+        size_t size = entry & ~DTACQ_CODEC_STORED;
+        size_t n = nElements - b * blockElements;
+        if (n > blockElements) n = blockElements;
+        size_t nBytes = n * elemSize;
+        if (pBlock + size > pEnd) return -1;
+        if (entry & DTACQ_CODEC_STORED) {
+            if (size != nBytes) return -1;
+            memcpy(&shuffled[0], pBlock, nBytes);
+        } else if (dtacqLz4Decompress(pBlock, (int)size, &shuffled[0], (int)nBytes) != (int)nBytes) {
+            return -1;
+        }
+        size_t nShuffled = n - n % 8;
+        bitUnshuffle(&shuffled[0], pOut, nShuffled, elemSize);
+        memcpy(pOut + nShuffled * elemSize, &shuffled[nShuffled * elemSize], (n - nShuffled) * elemSize);
+        pOut += nBytes;
+        pBlock += size;
+    }
+    if (elemSize == 2)
+        deltaDecode<int16_t, uint16_t>((uint16_t *)pDest, nRows, rowWidth, nData, dataShift);
+    else
+        deltaDecode<int32_t, uint32_t>((uint32_t *)pDest, nRows, rowWidth, nData, dataShift);
+    return (long)(nElements * elemSize);
+}
+
+/* Append an LZ4 length continuation (the part of a length beyond the 4 bit token field) */
+static inline uint8_t *putLength(uint8_t *op, int length)
+{
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+int dtacqLz4Compress(const uint8_t *pSrc, int srcSize, uint8_t *pDest, int destCapacity)
+{
+    /* Format limits: the last 5 bytes are always literals and the last match starts
+       at least 12 bytes before the end */
+    const int minMatch = 4, lastLiterals = 5, mfLimit = 12;
+    const int hashLog = 12;
+    int table[1 << hashLog];
+    const uint8_t *ip = pSrc, *anchor = pSrc;
+    const uint8_t *iend = pSrc + srcSize;
+    const uint8_t *mflimit = iend - mfLimit;
+    const uint8_t *matchlimit = iend - lastLiterals;
+    uint8_t *op = pDest;
+    uint8_t *oend = pDest + destCapacity;
+
+    for (int i = 0; i < (1 << hashLog); i++) table[i] = -1;
+    while (srcSize > mfLimit && ip < mflimit) {
+        uint32_t sequence = read32(ip);
+        uint32_t h = (sequence * 2654435761u) >> (32 - hashLog);
+        int ref = table[h];
+        table[h] = (int)(ip - pSrc);
+        if (ref < 0 || (ip - pSrc) - ref > 65535 || read32(pSrc + ref) != sequence) {
+            ip++;
+            continue;
+        }
+        const uint8_t *match = pSrc + ref;
+        const uint8_t *p = ip + minMatch, *m = match + minMatch;
+        while (p < matchlimit && *p == *m) {
+            p++;
+            m++;
+        }
+        int literals = (int)(ip - anchor);
+        int matchLength = (int)(p - ip) - minMatch;
+        if (op + 1 + literals / 255 + 1 + literals + 2 + matchLength / 255 + 1 > oend) return 0;
+        uint8_t *token = op++;
+        if (literals >= 15) {
+            *token = 15 << 4;
+            op = putLength(op, literals - 15);
+        } else {
+            *token = (uint8_t)(literals << 4);
+        }
+        memcpy(op, anchor, literals);
+        op += literals;
+        int offset = (int)(ip - match);
+        *op++ = offset & 0xff;
+        *op++ = (offset >> 8) & 0xff;
+        if (matchLength >= 15) {
+            *token |= 15;
+            op = putLength(op, matchLength - 15);
+        } else {
+            *token |= (uint8_t)matchLength;
+        }
+        ip = anchor = p;
+    }
+    int literals = (int)(iend - anchor);
+    if (op + 1 + literals / 255 + 1 + literals > oend) return 0;
+    uint8_t *token = op++;
+    if (literals >= 15) {
+        *token = 15 << 4;
+        op = putLength(op, literals - 15);
+    } else {
+        *token = (uint8_t)(literals << 4);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    return (int)(op - pDest);
+}
+
+int dtacqLz4Decompress(const uint8_t *pSrc, int srcSize, uint8_t *pDest, int destSize)
+{
+    const uint8_t *ip = pSrc, *iend = pSrc + srcSize;
+    uint8_t *op = pDest, *oend = pDest + destSize;
+    while (ip < iend) {
+        int token = *ip++;
+        int literals = token >> 4;
+        if (literals == 15) {
+            int b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                literals += b;
+            } while (b == 255);
+        }
+        if (literals > iend - ip || literals > oend - op) return -1;
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        /* The last sequence has no match */
+        if (ip == iend) break;
+        if (iend - ip < 2) return -1;
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - pDest) return -1;
+        int matchLength = token & 15;
+        if (matchLength == 15) {
+            int b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                matchLength += b;
+            } while (b == 255);
+        }
+        matchLength += 4;
+        if (matchLength > oend - op) return -1;
+        /* Matches may overlap the output being written, so copy forwards a byte at a time */
+        const uint8_t *m = op - offset;
+        while (matchLength--) *op++ = *m++;
+    }
+    return (int)(op - pDest);
+}
@@ -0,0 +1,68 @@
+#ifndef DTACQCOMPRESS_H
+#define DTACQCOMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/* Lossless codec for raw D-TACQ frames.
+
+   Each channel is delta encoded along time and zigzag mapped so that small
+   changes become small unsigned numbers. The result is split into blocks of
+   DTACQ_CODEC_BLOCK_ELEMENTS, each block is bit-plane transposed (bitshuffle)
+   so the mostly-zero high bits line up, and then compressed in LZ4 block format.
+   Blocks are independent, so they can be compressed on separate threads.
+
+   Data columns are masked (site/channel byte removed) and shifted down by
+   dataShift before encoding; scratchpad columns are encoded verbatim.
+   Decompression reproduces the masked raw frame bit for bit.
+
+   Layout of a compressed frame (all fields little-endian uint32):
+     magic, version, elemSize, rowWidth, nRows, nData, dataShift, blockElements, nBlocks,
+     blockSize[nBlocks], block payloads...
+   The top bit of blockSize marks a block stored uncompressed (after bitshuffle). */
+
+#define DTACQ_CODEC_MAGIC          0x5a515444   /* "DTQZ" */
+#define DTACQ_CODEC_VERSION        1
+#define DTACQ_CODEC_BLOCK_ELEMENTS 8192
+#define DTACQ_CODEC_STORED         0x80000000u
+#define DTACQ_CODEC_NAME           "dtacq-delta-bitshuffle-lz4"
+
+/* Description of a raw frame: nRows x rowWidth elements of elemSize bytes, row major */
+typedef struct DtacqCodecFrame {
+    const void *pData;
+    int elemSize;      /* 2 or 4 */
+    int rowWidth;
+    int nRows;
+    int nData;         /* Leading columns holding ADC data; the rest are scratchpad words */
+    int dataShift;     /* Bits below the ADC data in each data word (8 for 24 bit data in 32 bits) */
+} DtacqCodecFrame;
+
+/* Number of blocks a frame is split into */
+int dtacqCodecBlockCount(const DtacqCodecFrame *frame);
+
+/* Size of the header (including the block size table) for nBlocks blocks */
+size_t dtacqCodecHeaderSize(int nBlocks);
+
+/* Worst case compressed size of one block */
+size_t dtacqCodecBlockBound(const DtacqCodecFrame *frame);
+
+/* Compress block number block of frame into pDest, which must hold dtacqCodecBlockBound() bytes.
+   scratch is working space that may be reused between calls on the same thread.
+   Returns the block size entry for the header (with DTACQ_CODEC_STORED if not compressed) */
+uint32_t dtacqCompressBlock(const DtacqCodecFrame *frame, int block, uint8_t *pDest,
+                            std::vector<uint8_t> *scratch);
+
+/* Write the header for frame into pDest, which must hold dtacqCodecHeaderSize() bytes */
+void dtacqCodecWriteHeader(const DtacqCodecFrame *frame, const uint32_t *blockSizes, uint8_t *pDest);
+
+/* Decompress a complete compressed frame into pDest, which must hold destSize bytes.
+   Returns the number of bytes written, or -1 if the input is malformed or too large */
+long dtacqDecompress(const uint8_t *pSrc, size_t srcSize, void *pDest, size_t destSize);
+
+/* Plain LZ4 block format compression and decompression, exposed for reuse.
+   Compression returns 0 if the output would not fit in destCapacity. */
+int dtacqLz4Compress(const uint8_t *pSrc, int srcSize, uint8_t *pDest, int destCapacity);
+int dtacqLz4Decompress(const uint8_t *pSrc, int srcSize, uint8_t *pDest, int destSize);
+
+#endif /* DTACQCOMPRESS_H */
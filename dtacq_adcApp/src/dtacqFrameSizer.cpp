@@ -0,0 +1,105 @@
+#include <math.h>
+
+#include "dtacqFrameSizer.h"
+
+/* Weight of each new frame in the cost fit and the rate average */
+#define SIZER_DECAY      0.1
+/* A frame must last this much longer than its processing to keep up */
+#define SIZER_HEADROOM   1.25
+/* Relative change in length below which the current length is kept */
+#define SIZER_HYSTERESIS 0.1
+/* Spread of recent lengths, relative to their mean, needed to fit a fixed cost */
+#define SIZER_SPREAD     0.05
+
+dtacqFrameSizer::dtacqFrameSizer()
+{
+    reset();
+}
+
+void dtacqFrameSizer::reset()
+{
+    this->weight = 0;
+    this->sumN = this->sumCost = this->sumNN = this->sumNCost = 0;
+    this->rate = 0;
+    this->frames = 0;
+}
+
+void dtacqFrameSizer::addFrame(int nSamples, double cost, double interval)
+{
+    if (nSamples <= 0 || cost < 0) return;
+    double keep = 1.0 - SIZER_DECAY;
+    this->weight = keep * this->weight + 1.0;
+    this->sumN = keep * this->sumN + nSamples;
+    this->sumCost = keep * this->sumCost + cost;
+    this->sumNN = keep * this->sumNN + (double)nSamples * nSamples;
+    this->sumNCost = keep * this->sumNCost + nSamples * cost;
+    if (interval > 0) {
+        double frameRate = nSamples / interval;
+        this->rate = (this->rate > 0) ? keep * this->rate + SIZER_DECAY * frameRate : frameRate;
+    }
+    this->frames++;
+}
+
+void dtacqFrameSizer::getCost(double *fixed, double *perSample) const
+{
+    *fixed = *perSample = 0;
+    if (this->weight <= 0) return;
+    double meanN = this->sumN / this->weight;
+    double meanCost = this->sumCost / this->weight;
+    double varN = this->sumNN / this->weight - meanN * meanN;
+    if (this->frames > 2 && varN > SIZER_SPREAD * SIZER_SPREAD * meanN * meanN) {
+        double slope = (this->sumNCost / this->weight - meanN * meanCost) / varN;
+        double intercept = meanCost - slope * meanN;
+        if (slope >= 0 && intercept >= 0) {
+            *fixed = intercept;
+            *perSample = slope;
+            return;
+        }
+        if (slope < 0) {
+            /* Longer frames were no dearer: the cost is all overhead */
+            *fixed = meanCost;
+            return;
+        }
+    }
+    *perSample = meanCost / meanN;
+}
+
+double dtacqFrameSizer::minimumLength(double sampleRate) const
+{
+    double fixed, perSample;
+    getCost(&fixed, &perSample);
+    double margin = 1.0 / sampleRate - SIZER_HEADROOM * perSample;
+    if (margin <= 0) return 0;
+    double n = SIZER_HEADROOM * fixed / margin;
+    return (n < 1) ? 1 : n;
+}
+
+int dtacqFrameSizer::choose(int mode, double target, double sampleRate, int current,
+                            int minSamples, int maxSamples) const
+{
+    if (mode == DtacqAdaptOff || sampleRate <= 0 || target <= 0) return current;
+    if (minSamples < 1) minSamples = 1;
+    if (maxSamples < minSamples) maxSamples = minSamples;
+    double fixed, perSample;
+    getCost(&fixed, &perSample);
+    double n;
+    if (mode == DtacqAdaptPeriod) {
+        n = target * sampleRate;
+    } else {
+        /* N / R + fixed + perSample * N = target */
+        n = (target - fixed) / (1.0 / sampleRate + perSample);
+    }
+    /* Falling behind costs more latency than any frame length saves */
+    double shortest = minimumLength(sampleRate);
+    if (shortest == 0)
+        n = maxSamples;
+    else if (n < shortest)
+        n = shortest;
+    if (n < minSamples) n = minSamples;
+    if (n > maxSamples) n = maxSamples;
+    int chosen = (int)floor(n + 0.5);
+    if (current >= minSamples && current <= maxSamples &&
+        fabs((double)(chosen - current)) <= SIZER_HYSTERESIS * current)
+        return current;
+    return chosen;
+}
@@ -0,0 +1,46 @@
+#ifndef DTACQFRAMESIZER_H
+#define DTACQFRAMESIZER_H
+
+/* Frame length selection for the adaptive frame mode.
+
+   The processing cost of a frame (from the end of its read to the end of publishing)
+   is modelled as fixed + perSample * nSamples, fitted by least squares over a decaying
+   history of frames, so frames of different lengths separate the two terms. Until the
+   lengths have varied enough the whole cost is taken as per sample.
+
+   With sample rate R a frame of N samples covers N / R seconds, and the first sample
+   in it is published N / R + cost(N) after it was taken. choose() solves for the N
+   that gives the target period or latency, never going below the length at which the
+   pipeline can no longer keep up with the data. */
+
+typedef enum DtacqAdaptMode {
+  DtacqAdaptOff=0,      /* ADSizeY is used as set */
+  DtacqAdaptPeriod=1,   /* Frames last ADAPT_TARGET seconds */
+  DtacqAdaptLatency=2   /* Samples are published within ADAPT_TARGET seconds of being taken */
+} DtacqAdaptMode;
+
+class dtacqFrameSizer {
+public:
+    dtacqFrameSizer();
+    /* Forget the cost history and the measured rate */
+    void reset();
+    /* Record a frame of nSamples that took cost seconds to process, interval seconds
+       after the previous frame finished reading (0 if there was no previous frame) */
+    void addFrame(int nSamples, double cost, double interval);
+    /* Sample rate measured from the frame intervals, 0 until there is one */
+    double measuredRate() const { return this->rate; }
+    /* Fitted cost model, in seconds and seconds per sample */
+    void getCost(double *fixed, double *perSample) const;
+    /* Smallest frame the pipeline can keep up with at sampleRate, 0 if it cannot at any length */
+    double minimumLength(double sampleRate) const;
+    /* The frame length for mode and target at sampleRate, between minSamples and maxSamples.
+       current is kept unless the new length differs from it by more than the hysteresis */
+    int choose(int mode, double target, double sampleRate, int current, int minSamples, int maxSamples) const;
+
+private:
+    double weight, sumN, sumCost, sumNN, sumNCost;
+    double rate;
+    int frames;
+};
+
+#endif /* DTACQFRAMESIZER_H */
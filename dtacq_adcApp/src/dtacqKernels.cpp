@@ -0,0 +1,95 @@
+#include <string.h>
+#include <math.h>
+
+#include "dtacqKernels.h"
+
+void dtacqSetLayout(DtacqFrameLayout *layout, int wordBytes, int nChannels, int spadWords, int dix)
+{
+    if (spadWords < 0) spadWords = 0;
+    if (spadWords > DTACQ_MAX_SPAD_WORDS) spadWords = DTACQ_MAX_SPAD_WORDS;
+    layout->wordBytes = (wordBytes == 2) ? 2 : 4;
+    layout->nChannels = nChannels;
+    layout->spadWords = spadWords;
+    layout->dix = (spadWords > 0 && dix) ? 1 : 0;
+}
+
+int dtacqSpadColumns(const DtacqFrameLayout *layout)
+{
+    return layout->spadWords * (int)sizeof(epicsUInt32) / layout->wordBytes;
+}
+
+int dtacqRowWidth(const DtacqFrameLayout *layout)
+{
+    return layout->nChannels + dtacqSpadColumns(layout);
+}
+
+size_t dtacqSpadOffset(const DtacqFrameLayout *layout, int n)
+{
+    return (size_t)layout->nChannels * layout->wordBytes + (size_t)n * sizeof(epicsUInt32);
+}
+
+bool dtacqHasSampleCounter(const DtacqFrameLayout *layout)
+{
+    return layout->spadWords > 0 && !(layout->dix && layout->spadWords == 1);
+}
+
+void dtacqReadSpad(const void *pRow, const DtacqFrameLayout *layout, epicsUInt32 *spad)
+{
+    memcpy(spad, (const uint8_t *)pRow + dtacqSpadOffset(layout, 0), layout->spadWords * sizeof(epicsUInt32));
+}
+
+int dtacqDataColumns(int rawWidth, int skipCount, int firstChannel, int nOut, int nScale)
+{
+    int nData = rawWidth - skipCount;
+    if (nData > nScale) nData = nScale;
+    nData -= firstChannel;
+    if (nData > nOut) nData = nOut;
+    return (nData < 0) ? 0 : nData;
+}
+
+void dtacqMaskData(epicsInt32 *pData, size_t nRows, int rowWidth, int nData, epicsInt32 mask)
+{
+    for (size_t i = 0; i < nRows; i++, pData += rowWidth)
+        for (int c = 0; c < nData; c++)
+            pData[c] &= mask;
+}
+
+int dtacqCheckSampleCounts(const void *pData, int nRows, size_t rowBytes, size_t counterOffset,
+                           uint64_t *next, bool *valid, uint64_t *badExpected, uint32_t *badValue)
+{
+    int nBad = 0;
+    const uint8_t *pCount = (const uint8_t *)pData + counterOffset;
+    for (int i = 0; i < nRows; i++, pCount += rowBytes) {
+        uint32_t count;
+        memcpy(&count, pCount, sizeof(count));
+        if (*valid && count != *next) {
+            if (nBad++ == 0) {
+                *badExpected = *next;
+                *badValue = count;
+            }
+            *valid = false;
+            continue;
+        }
+        /* The carrier's counter is 32 bits and wraps */
+        *next = (count == 0xffffffffu) ? 0 : (uint64_t)count + 1;
+        *valid = true;
+    }
+    return nBad;
+}
+
+int dtacqFindIdMismatch(const epicsInt32 *pData, int nRows, int rowWidth, int nData,
+                        const epicsInt32 *signature)
+{
+    /* The inner loop is a branch-free OR reduction so the compiler can vectorise it */
+    for (int r = 0; r < nRows; r++, pData += rowWidth) {
+        epicsInt32 diff = 0;
+        for (int c = 0; c < nData; c++) diff |= pData[c] ^ signature[c];
+        if (diff & 0xff) return r;
+    }
+    return -1;
+}
+
+double dtacqCountToVolts(double range, int nbits)
+{
+    return 2 * range / pow(2, nbits);
+}
@@ -0,0 +1,123 @@
+#ifndef DTACQKERNELS_H
+#define DTACQKERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <epicsTypes.h>
+
+/* The per-sample processing of raw D-TACQ frames, kept free of any driver, asyn or
+   NDArray state so it can be driven directly on synthetic frames.
+
+   A raw frame is nRows rows of rowWidth words (epicsInt16 or epicsInt32). The first
+   nData words of each row are ADC data; the rest are scratchpad words, described by a
+   DtacqFrameLayout. In 32 bit mode the low byte of each data word holds the site/channel ID. */
+
+#define DTACQ_MAX_SPAD_WORDS 8
+
+/* Layout of each row as configured on the carrier with "spad <enable>,<words>,<DIX>".
+   The scratchpad is spadWords 32 bit words after the data, so in 16 bit mode each word
+   takes two columns (low half first). Word 0 holds the sample counter; with DIX set the
+   carrier writes its digital inputs into the last word */
+typedef struct DtacqFrameLayout {
+    int wordBytes;     /* 2 or 4 */
+    int nChannels;     /* ADC data columns */
+    int spadWords;     /* 0 when the scratchpad is disabled, else 1 to DTACQ_MAX_SPAD_WORDS */
+    int dix;
+} DtacqFrameLayout;
+
+/* Fill in a layout, clamping spadWords to the range the carrier supports */
+void dtacqSetLayout(DtacqFrameLayout *layout, int wordBytes, int nChannels, int spadWords, int dix);
+
+/* Columns taken by the scratchpad, and the total width of a row, in words */
+int dtacqSpadColumns(const DtacqFrameLayout *layout);
+int dtacqRowWidth(const DtacqFrameLayout *layout);
+
+/* Byte offset of scratchpad word n within a row */
+size_t dtacqSpadOffset(const DtacqFrameLayout *layout, int n);
+
+/* Whether the sample counter can be checked: scratchpad on and word 0 not taken by DIX */
+bool dtacqHasSampleCounter(const DtacqFrameLayout *layout);
+
+/* Copy the spadWords scratchpad words of one row into spad[] */
+void dtacqReadSpad(const void *pRow, const DtacqFrameLayout *layout, epicsUInt32 *spad);
+
+/* Convert a block of raw samples to volts in a single pass: gather outWidth channels
+   from each row of inWidth raw words, mask off the site/channel byte and apply each
+   channel's slope and offset. pIn, scale and offset point at the first selected channel.
+   Columns from nData onwards are scratchpad words and are copied through unscaled. */
+template <typename epicsType>
+void dtacqRawToVolts(const epicsType *pIn, double *pOut, size_t nSamples, int inWidth, int outWidth,
+                     int nData, epicsType mask, const double *scale, const double *offset)
+{
+    for (size_t i = 0; i < nSamples; i++, pIn += inWidth, pOut += outWidth) {
+        for (int c = 0; c < nData; c++)
+            pOut[c] = (epicsType)(pIn[c] & mask) * scale[c] + offset[c];
+        for (int c = nData; c < outWidth; c++)
+            pOut[c] = pIn[c];
+    }
+}
+
+/* As dtacqRawToVolts, with the number of scratchpad columns copied through fixed at
+   compile time so the copy is unrolled; outWidth must be nData + SpadColumns */
+template <typename epicsType, int SpadColumns>
+void dtacqRawToVoltsFixed(const epicsType *pIn, double *pOut, size_t nSamples, int inWidth, int outWidth,
+                          int nData, epicsType mask, const double *scale, const double *offset)
+{
+    for (size_t i = 0; i < nSamples; i++, pIn += inWidth, pOut += outWidth) {
+        for (int c = 0; c < nData; c++)
+            pOut[c] = (epicsType)(pIn[c] & mask) * scale[c] + offset[c];
+        for (int c = 0; c < SpadColumns; c++)
+            pOut[nData + c] = pIn[nData + c];
+    }
+}
+
+/* The conversion kernel instance for frames of epicsType carrying spadColumns scratchpad
+   columns (up to the 16 of eight words in 16 bit mode), chosen once per frame */
+template <typename epicsType>
+struct dtacqToVolts {
+    typedef void (*func)(const epicsType *, double *, size_t, int, int, int, epicsType,
+                         const double *, const double *);
+    static func select(int spadColumns)
+    {
+        static const func kernels[2 * DTACQ_MAX_SPAD_WORDS + 1] = {
+            dtacqRawToVoltsFixed<epicsType, 0>,  dtacqRawToVoltsFixed<epicsType, 1>,
+            dtacqRawToVoltsFixed<epicsType, 2>,  dtacqRawToVoltsFixed<epicsType, 3>,
+            dtacqRawToVoltsFixed<epicsType, 4>,  dtacqRawToVoltsFixed<epicsType, 5>,
+            dtacqRawToVoltsFixed<epicsType, 6>,  dtacqRawToVoltsFixed<epicsType, 7>,
+            dtacqRawToVoltsFixed<epicsType, 8>,  dtacqRawToVoltsFixed<epicsType, 9>,
+            dtacqRawToVoltsFixed<epicsType, 10>, dtacqRawToVoltsFixed<epicsType, 11>,
+            dtacqRawToVoltsFixed<epicsType, 12>, dtacqRawToVoltsFixed<epicsType, 13>,
+            dtacqRawToVoltsFixed<epicsType, 14>, dtacqRawToVoltsFixed<epicsType, 15>,
+            dtacqRawToVoltsFixed<epicsType, 16>
+        };
+        if (spadColumns < 0 || spadColumns > 2 * DTACQ_MAX_SPAD_WORDS)
+            return dtacqRawToVolts<epicsType>;
+        return kernels[spadColumns];
+    }
+};
+
+/* Number of the nOut selected columns, starting at firstChannel, that hold ADC data
+   rather than scratchpad words, given rows of rawWidth words and nScale scale factors */
+int dtacqDataColumns(int rawWidth, int skipCount, int firstChannel, int nOut, int nScale);
+
+/* Mask the data columns of a 32 bit frame in place, leaving the scratchpad words alone */
+void dtacqMaskData(epicsInt32 *pData, size_t nRows, int rowWidth, int nData, epicsInt32 mask);
+
+/* Check the 32 bit sample counter at counterOffset in each row of rowBytes bytes. *next is the count
+   expected in the next row and is only valid if *valid is set; both carry over between
+   frames. After a mismatch the count is picked up again from the following row.
+   Returns the number of mismatched rows; the first mismatch is described in
+   *badExpected and *badValue */
+int dtacqCheckSampleCounts(const void *pData, int nRows, size_t rowBytes, size_t counterOffset,
+                           uint64_t *next, bool *valid, uint64_t *badExpected, uint32_t *badValue);
+
+/* Index of the first row whose site/channel ID bytes differ from signature[0..nData),
+   or -1 if they all match */
+int dtacqFindIdMismatch(const epicsInt32 *pData, int nRows, int rowWidth, int nData,
+                        const epicsInt32 *signature);
+
+/* Volts per ADC code for a bipolar range of +/-range volts sampled with nbits bits */
+double dtacqCountToVolts(double range, int nbits);
+
+#endif /* DTACQKERNELS_H */
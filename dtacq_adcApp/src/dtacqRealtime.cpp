@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <epicsThread.h>
+#include <epicsTime.h>
+#include <epicsStdio.h>
+
+#include "dtacqRealtime.h"
+
+void dtacqSetSchedule(DtacqSchedule *schedule, int priority, const char *cpus)
+{
+    schedule->priority = (priority < 0) ? 0 : priority;
+    schedule->cpus[0] = '\0';
+    if (cpus) {
+        strncpy(schedule->cpus, cpus, DTACQ_CPU_LIST_LEN - 1);
+        schedule->cpus[DTACQ_CPU_LIST_LEN - 1] = '\0';
+    }
+}
+
+#ifdef __linux__
+/* Parse a list such as "1,3-5" into set. Returns 0, or EINVAL if the list is malformed */
+static int parseCpuList(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p) {
+        char *pEnd;
+        long first = strtol(p, &pEnd, 10);
+        if (pEnd == p || first < 0) return EINVAL;
+        long last = first;
+        p = pEnd;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &pEnd, 10);
+            if (pEnd == p || last < first) return EINVAL;
+            p = pEnd;
+        }
+        if (last >= CPU_SETSIZE) return EINVAL;
+        for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, set);
+        if (*p == ',') p++;
+        else if (*p) return EINVAL;
+    }
+    return 0;
+}
+
+int dtacqApplySchedule(const DtacqSchedule *schedule, char *message, size_t messageLen)
+{
+    int status;
+    if (schedule->cpus[0]) {
+        cpu_set_t set;
+        status = parseCpuList(schedule->cpus, &set);
+        if (status == 0) status = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (status) {
+            epicsSnprintf(message, messageLen, "CPUs %s: %s", schedule->cpus, strerror(status));
+            return status;
+        }
+    }
+    if (schedule->priority > 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = schedule->priority;
+        status = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (status) {
+            epicsSnprintf(message, messageLen, "SCHED_FIFO %d: %s", schedule->priority, strerror(status));
+            return status;
+        }
+    }
+    int policy;
+    struct sched_param param;
+    pthread_getschedparam(pthread_self(), &policy, &param);
+    epicsSnprintf(message, messageLen, "%s %d, CPUs %s",
+                  (policy == SCHED_FIFO) ? "FIFO" : (policy == SCHED_RR) ? "RR" : "OTHER",
+                  param.sched_priority, schedule->cpus[0] ? schedule->cpus : "any");
+    return 0;
+}
+#else
+int dtacqApplySchedule(const DtacqSchedule *schedule, char *message, size_t messageLen)
+{
+    if (schedule->priority > 0 || schedule->cpus[0]) {
+        epicsSnprintf(message, messageLen, "Real-time scheduling not supported on this OS");
+        return ENOSYS;
+    }
+    epicsSnprintf(message, messageLen, "Default scheduling");
+    return 0;
+}
+#endif
+
+double dtacqProbeLatency(int nProbes, double interval)
+{
+    double worst = 0.0;
+    for (int i = 0; i < nProbes; i++) {
+        epicsTimeStamp before, after;
+        epicsTimeGetCurrent(&before);
+        epicsThreadSleep(interval);
+        epicsTimeGetCurrent(&after);
+        double late = epicsTimeDiffInSeconds(&after, &before) - interval;
+        if (late > worst) worst = late;
+    }
+    return worst * 1.e6;
+}
@@ -0,0 +1,27 @@
+#ifndef DTACQREALTIME_H
+#define DTACQREALTIME_H
+
+#include <stddef.h>
+
+/* Real-time scheduling for the acquisition threads. A schedule is applied by the thread
+   it is meant for, so it can be changed while the threads are already running. */
+
+#define DTACQ_CPU_LIST_LEN 64
+
+typedef struct DtacqSchedule {
+    int priority;                   /* SCHED_FIFO priority (1-99); 0 leaves the policy alone */
+    char cpus[DTACQ_CPU_LIST_LEN];  /* CPUs to run on, e.g. "2" or "4-7,10"; empty for any */
+} DtacqSchedule;
+
+/* Fill in a schedule, taking care of NULL or over-long CPU lists */
+void dtacqSetSchedule(DtacqSchedule *schedule, int priority, const char *cpus);
+
+/* Apply schedule to the calling thread. A description of the result (or of the failure)
+   is written to message. Returns 0 on success, otherwise an errno value */
+int dtacqApplySchedule(const DtacqSchedule *schedule, char *message, size_t messageLen);
+
+/* Sleep nProbes times for interval seconds and return the worst wake-up delay beyond
+   the requested interval, in microseconds */
+double dtacqProbeLatency(int nProbes, double interval);
+
+#endif /* DTACQREALTIME_H */
@@ -0,0 +1,146 @@
+#include <string.h>
+
+#include "dtacqSampleRing.h"
+
+dtacqSampleRing::dtacqSampleRing(NDArrayPool *pool, int nShells, int windowsPerRing)
+    : pool(pool), windowsPerRing(windowsPerRing), nWidth(0), nLength(0), nHop(0),
+      capacity(0), readPos(0), writePos(0), skip(0), readSample(0)
+{
+    this->shells.assign(nShells, (NDArray *)NULL);
+    this->shellFirst.assign(nShells, 0);
+    this->shellLast.assign(nShells, 0);
+}
+
+bool dtacqSampleRing::matches(int width, int length, int hop) const
+{
+    return width == this->nWidth && length == this->nLength && hop == this->nHop;
+}
+
+/* True if a window still held by a plugin covers any of the elements [first, last) of the
+   buffer. Windows are recorded in elements rather than rows, so ones handed out before the
+   width changed are still compared correctly */
+bool dtacqSampleRing::pinnedElements(size_t first, size_t last) const
+{
+    for (size_t s = 0; s < this->shells.size(); s++) {
+        if (!this->shells[s] || this->shells[s]->getReferenceCount() <= 1) continue;
+        if (first < this->shellLast[s] && this->shellFirst[s] < last) return true;
+    }
+    return false;
+}
+
+/* True if a window still held by a plugin covers any of the rows [first, last) */
+bool dtacqSampleRing::pinned(size_t first, size_t last) const
+{
+    return pinnedElements(first * this->nWidth, last * this->nWidth);
+}
+
+bool dtacqSampleRing::configure(int width, int length, int hop)
+{
+    if (width <= 0 || length <= 0) return false;
+    if (hop <= 0) hop = length;
+    size_t capacity = (size_t)length * this->windowsPerRing;
+    if (capacity * width > this->buffer.size()) {
+        /* Growing moves the buffer, so every window handed out must have been released */
+        if (this->pinnedElements(0, this->buffer.size())) return false;
+        this->buffer.resize(capacity * width);
+    }
+    this->nWidth = width;
+    this->nLength = length;
+    this->nHop = hop;
+    this->capacity = capacity;
+    this->readPos = this->writePos = 0;
+    this->skip = 0;
+    this->readSample = 0;
+    return true;
+}
+
+void dtacqSampleRing::restart()
+{
+    /* With a skip pending, readSample already counts the samples still to be skipped (see
+       nextWindow()), but the next sample appended comes before them */
+    this->readSample += (double)(this->writePos - this->readPos) - (double)this->skip;
+    this->readPos = this->writePos;
+    this->skip = 0;
+}
+
+void dtacqSampleRing::skipSamples(double nSamples)
+{
+    if (nSamples > 0) this->readSample += nSamples;
+}
+
+int dtacqSampleRing::append(const double *pData, int nRows)
+{
+    if (this->capacity == 0 || nRows <= 0) return 0;
+    if (this->skip) {
+        int skipped = (this->skip < (size_t)nRows) ? (int)this->skip : nRows;
+        this->skip -= skipped;
+        return skipped;
+    }
+    size_t pending = this->writePos - this->readPos;
+    if (pending >= (size_t)this->nLength) return 0;
+    size_t rows = nRows;
+    if (this->writePos + rows > this->capacity) {
+        /* Wrap: move the pending tail to the start of the ring */
+        if (this->readPos > 0) {
+            if (this->pinned(0, pending)) return 0;
+            memmove(&this->buffer[0], &this->buffer[this->readPos * this->nWidth],
+                    pending * this->nWidth * sizeof(double));
+            this->readPos = 0;
+            this->writePos = pending;
+        }
+        if (this->writePos + rows > this->capacity) rows = this->capacity - this->writePos;
+    }
+    if (rows == 0 || this->pinned(this->writePos, this->writePos + rows)) return 0;
+    memcpy(&this->buffer[this->writePos * this->nWidth], pData, rows * this->nWidth * sizeof(double));
+    this->writePos += rows;
+    return (int)rows;
+}
+
+NDArray *dtacqSampleRing::nextWindow(double *firstSample, bool *dropped)
+{
+    *dropped = false;
+    if (this->writePos - this->readPos < (size_t)this->nLength) return NULL;
+    size_t first = this->readPos;
+    *firstSample = this->readSample;
+    this->readPos += this->nHop;
+    this->readSample += this->nHop;
+    if (this->readPos > this->writePos) {
+        /* Hop longer than the window: the samples in between are never used */
+        this->skip = this->readPos - this->writePos;
+        this->readPos = this->writePos;
+    }
+
+    int free = -1;
+    for (size_t s = 0; s < this->shells.size() && free < 0; s++) {
+        if (!this->shells[s] || this->shells[s]->getReferenceCount() <= 1) free = (int)s;
+    }
+    if (free < 0) {
+        *dropped = true;
+        return NULL;
+    }
+    size_t dims[2];
+    dims[0] = this->nWidth;
+    dims[1] = this->nLength;
+    size_t windowBytes = (size_t)this->nLength * this->nWidth * sizeof(double);
+    double *pWindow = &this->buffer[first * this->nWidth];
+    NDArray *pArray = this->shells[free];
+    if (!pArray) {
+        /* The ring keeps this reference for good, so the shell is never recycled by the pool */
+        pArray = this->pool->alloc(2, dims, NDFloat64, windowBytes, pWindow);
+        if (!pArray) {
+            *dropped = true;
+            return NULL;
+        }
+        this->shells[free] = pArray;
+    }
+    pArray->ndims = 2;
+    pArray->initDimension(&pArray->dims[0], dims[0]);
+    pArray->initDimension(&pArray->dims[1], dims[1]);
+    pArray->dataType = NDFloat64;
+    pArray->pData = pWindow;
+    pArray->dataSize = windowBytes;
+    pArray->pAttributeList->clear();
+    this->shellFirst[free] = first * this->nWidth;
+    this->shellLast[free] = (first + this->nLength) * this->nWidth;
+    return pArray;
+}
@@ -0,0 +1,55 @@
+#ifndef DTACQSAMPLERING_H
+#define DTACQSAMPLERING_H
+
+#include <stddef.h>
+#include <vector>
+
+#include "NDArray.h"
+
+/* A ring of converted (NDFloat64) samples that hands out overlapping windows of
+   `length` rows every `hop` rows without copying them: each window is an NDArray whose
+   pData points into the ring. The windows come from a fixed set of NDArray "shells"
+   that the ring always holds a reference to, so they never go back to the NDArrayPool
+   free list with ring memory attached. A shell still held by a plugin pins its rows,
+   and the ring will not overwrite pinned rows.
+
+   Only the pending tail (fewer than `length` rows) is ever moved, and only when the
+   ring wraps, so consecutive windows share the overlap with no per-window copy. */
+class dtacqSampleRing {
+public:
+    dtacqSampleRing(NDArrayPool *pool, int nShells, int windowsPerRing);
+    /* Set the geometry and discard any buffered samples. Returns false (and changes
+       nothing) if the ring has to grow while plugins still hold windows from it */
+    bool configure(int width, int length, int hop);
+    bool matches(int width, int length, int hop) const;
+    /* Copy up to nRows rows into the ring; returns the number taken, which is less than
+       nRows if the space is pinned by windows plugins still hold or the ring is full
+       of pending rows, in which case nextWindow() should be called before trying again */
+    int append(const double *pData, int nRows);
+    /* Skip the samples buffered so far; the next window starts with the next sample appended */
+    void restart();
+    /* Count nSamples lost from the stream since the last sample appended, so that window
+       start indices stay in step with the carrier; call after restart() */
+    void skipSamples(double nSamples);
+    /* The next complete window, or NULL. *firstSample is its first sample's index since
+       configure(). Returns NULL with *dropped set if a window was due but no shell was free */
+    NDArray *nextWindow(double *firstSample, bool *dropped);
+    int width() const { return this->nWidth; }
+
+private:
+    bool pinned(size_t first, size_t last) const;
+    bool pinnedElements(size_t first, size_t last) const;
+    NDArrayPool *pool;
+    int windowsPerRing;
+    int nWidth, nLength, nHop;
+    std::vector<double> buffer;
+    size_t capacity;      /* Rows */
+    size_t readPos;       /* First row of the next window */
+    size_t writePos;      /* Row the next sample goes to */
+    size_t skip;          /* Samples still to be thrown away when the hop is longer than the window */
+    double readSample;    /* Index of the sample at readPos */
+    std::vector<NDArray *> shells;
+    std::vector<size_t> shellFirst, shellLast;   /* Elements of the buffer each shell covers */
+};
+
+#endif /* DTACQSAMPLERING_H */
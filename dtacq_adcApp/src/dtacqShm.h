@@ -0,0 +1,111 @@
+#ifndef DTACQSHM_H
+#define DTACQSHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Ring of frames in POSIX shared memory, written by the driver and mapped directly by
+   any number of reader processes on the same host.
+
+   The object starts with a DtacqShmHeader followed by nSlots slots of slotBytes each.
+   Every slot is a DtacqShmSlot header and then the frame data, both 64 byte aligned.
+   Frames are numbered from 1 and frame n goes into slot (n - 1) % nSlots.
+
+   The writer never waits for readers. Each slot carries a sequence word:
+     seq = 2n + 1   while frame n is being written
+     seq = 2n       once frame n is complete
+   After committing a frame the writer stores n in head and bumps the wake counter.
+   A reader checks that seq is 2n before and after copying the frame description, uses
+   the data in place, and checks seq again when it has finished. If seq has changed
+   the slot was reused meanwhile and the data must be discarded.
+
+   When the writer replaces the ring (new name, size or slot count) it sets closed in
+   the old header and unlinks it; readers then reopen the name. */
+
+#define DTACQ_SHM_MAGIC      0x4d485344u   /* "DSHM" */
+#define DTACQ_SHM_VERSION    1
+#define DTACQ_SHM_MAX_DIMS   4
+#define DTACQ_SHM_MAX_SPAD   8
+#define DTACQ_SHM_ALIGN      64
+
+typedef struct DtacqShmHeader {
+    volatile uint32_t magic;     /* Written last when the ring is created */
+    uint32_t version;
+    uint32_t nSlots;
+    uint32_t headerBytes;        /* Offset of slot 0 */
+    uint64_t slotBytes;          /* Distance between slots */
+    uint64_t dataCapacity;       /* Bytes of frame data a slot can hold */
+    volatile uint64_t head;      /* Newest complete frame, 0 before the first */
+    volatile uint32_t wake;      /* Incremented after every commit (a futex word on Linux) */
+    volatile uint32_t closed;    /* Set when the writer has abandoned this ring */
+    int64_t writerPid;
+} DtacqShmHeader;
+
+/* Description of one frame; dataType uses the NDDataType_t codes */
+typedef struct DtacqShmFrameInfo {
+    uint64_t frame;
+    int32_t uniqueId;
+    int32_t dataType;
+    int32_t ndims;
+    int32_t spadWords;           /* Scratchpad words of the frame's first sample in spad[] */
+    uint64_t dims[DTACQ_SHM_MAX_DIMS];   /* dims[0] varies fastest */
+    uint64_t dataBytes;
+    double timeStamp;
+    uint32_t secPastEpoch;
+    uint32_t nsec;
+    uint32_t spad[DTACQ_SHM_MAX_SPAD];
+} DtacqShmFrameInfo;
+
+typedef struct DtacqShmSlot {
+    volatile uint64_t seq;
+    uint64_t reserved;
+    DtacqShmFrameInfo info;
+} DtacqShmSlot;
+
+/* Offset of the frame data within a slot */
+#define DTACQ_SHM_SLOT_DATA  ((sizeof(DtacqShmSlot) + DTACQ_SHM_ALIGN - 1) / DTACQ_SHM_ALIGN * DTACQ_SHM_ALIGN)
+
+/* Reader library. Needs nothing from EPICS, so any local process can link it */
+
+#define DTACQ_SHM_OK         0
+#define DTACQ_SHM_TIMEOUT    1   /* No new frame within the timeout */
+#define DTACQ_SHM_CLOSED     2   /* The writer replaced the ring; close and open the name again */
+
+typedef struct dtacqShmReader dtacqShmReader;
+
+typedef struct DtacqShmFrame {
+    DtacqShmFrameInfo info;      /* A consistent copy of the slot's description */
+    const void *pData;           /* The data in place in the ring, valid while dtacqShmValid() */
+    const DtacqShmSlot *pSlot;
+    uint64_t seq;
+} DtacqShmFrame;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Map the ring called name (as given to SHM_NAME) read-only. Returns NULL with errno set
+   on failure; EAGAIN means the writer has not finished creating it */
+dtacqShmReader *dtacqShmOpen(const char *name);
+
+/* Wait up to timeout seconds (< 0 waits forever) for a frame newer than the last one
+   returned. The next frame in sequence is returned while it is still in the ring,
+   otherwise the newest one, and the frames passed over are counted as missed */
+int dtacqShmWait(dtacqShmReader *reader, DtacqShmFrame *frame, double timeout);
+
+/* Non-zero if the frame's slot has not been reused since it was returned. Check this
+   after using the data: a zero return means the data may have been overwritten */
+int dtacqShmValid(const DtacqShmFrame *frame);
+
+/* Frames skipped because the reader fell more than a ring behind */
+uint64_t dtacqShmMissed(const dtacqShmReader *reader);
+
+const DtacqShmHeader *dtacqShmHeader(const dtacqShmReader *reader);
+
+void dtacqShmClose(dtacqShmReader *reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DTACQSHM_H */
@@ -0,0 +1,181 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "dtacqShm.h"
+
+struct dtacqShmReader {
+    int fd;
+    size_t mapBytes;
+    const DtacqShmHeader *header;
+    uint64_t last;
+    uint64_t missed;
+};
+
+static const DtacqShmSlot *slotOf(const dtacqShmReader *reader, uint64_t n)
+{
+    const DtacqShmHeader *header = reader->header;
+    return (const DtacqShmSlot *)((const char *)header + header->headerBytes +
+                                  ((n - 1) % header->nSlots) * header->slotBytes);
+}
+
+/* Take a consistent copy of frame n's description; 0 if the slot no longer holds it */
+static int takeFrame(dtacqShmReader *reader, uint64_t n, DtacqShmFrame *frame)
+{
+    const DtacqShmSlot *pSlot = slotOf(reader, n);
+    uint64_t seq = pSlot->seq;
+    __sync_synchronize();
+    if (seq != 2 * n) return 0;
+    memcpy(&frame->info, (const void *)&pSlot->info, sizeof(frame->info));
+    __sync_synchronize();
+    if (pSlot->seq != seq) return 0;
+    if (frame->info.dataBytes > reader->header->dataCapacity) return 0;
+    frame->pData = (const char *)pSlot + DTACQ_SHM_SLOT_DATA;
+    frame->pSlot = pSlot;
+    frame->seq = seq;
+    return 1;
+}
+
+/* Sleep until the wake counter moves on from wake, or for at most seconds */
+static void waitForCommit(const dtacqShmReader *reader, uint32_t wake, double seconds)
+{
+    struct timespec ts;
+    if (seconds > 1.0 || seconds < 0) seconds = 1.0;
+#ifdef __linux__
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    if (syscall(SYS_futex, &reader->header->wake, FUTEX_WAIT, wake, &ts, NULL, 0) == 0 ||
+        errno == EAGAIN || errno == ETIMEDOUT || errno == EINTR)
+        return;
+    /* Older kernels refuse to wait on a read-only mapping; poll instead */
+    if (seconds > 0.001) seconds = 0.001;
+    ts.tv_sec = 0;
+    ts.tv_nsec = (long)(seconds * 1e9);
+    nanosleep(&ts, NULL);
+#else
+    /* Poll where there is no futex */
+    (void)wake;
+    if (seconds > 0.001) seconds = 0.001;
+    ts.tv_sec = 0;
+    ts.tv_nsec = (long)(seconds * 1e9);
+    nanosleep(&ts, NULL);
+#endif
+}
+
+static double monotonicNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+dtacqShmReader *dtacqShmOpen(const char *name)
+{
+    struct stat st;
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(DtacqShmHeader)) {
+        close(fd);
+        errno = EAGAIN;
+        return NULL;
+    }
+    void *pBase = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (pBase == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    const DtacqShmHeader *header = (const DtacqShmHeader *)pBase;
+    int ok = header->magic == DTACQ_SHM_MAGIC;
+    __sync_synchronize();
+    if (ok && (header->version != DTACQ_SHM_VERSION || header->nSlots == 0 ||
+               header->headerBytes + header->nSlots * header->slotBytes > (uint64_t)st.st_size)) {
+        munmap(pBase, (size_t)st.st_size);
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!ok) {
+        munmap(pBase, (size_t)st.st_size);
+        close(fd);
+        errno = EAGAIN;
+        return NULL;
+    }
+    dtacqShmReader *reader = (dtacqShmReader *)calloc(1, sizeof(dtacqShmReader));
+    if (reader == NULL) {
+        munmap(pBase, (size_t)st.st_size);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    reader->fd = fd;
+    reader->mapBytes = (size_t)st.st_size;
+    reader->header = header;
+    /* Start from the newest frame rather than replaying the whole ring */
+    reader->last = header->head ? header->head - 1 : 0;
+    return reader;
+}
+
+int dtacqShmWait(dtacqShmReader *reader, DtacqShmFrame *frame, double timeout)
+{
+    const DtacqShmHeader *header = reader->header;
+    double deadline = monotonicNow() + timeout;
+    for (;;) {
+        if (header->closed) return DTACQ_SHM_CLOSED;
+        uint32_t wake = header->wake;
+        __sync_synchronize();
+        uint64_t head = header->head;
+        while (head > reader->last) {
+            /* The next frame in sequence if the writer has not lapped us, else the newest */
+            uint64_t n = reader->last + 1;
+            if (head - n >= header->nSlots || !takeFrame(reader, n, frame)) {
+                n = head;
+                if (!takeFrame(reader, n, frame)) {
+                    /* Overwritten as we looked; try again with the new head */
+                    head = header->head;
+                    continue;
+                }
+            }
+            reader->missed += n - reader->last - 1;
+            reader->last = n;
+            return DTACQ_SHM_OK;
+        }
+        double remaining = deadline - monotonicNow();
+        if (timeout >= 0 && remaining <= 0) return DTACQ_SHM_TIMEOUT;
+        waitForCommit(reader, wake, timeout < 0 ? 1.0 : remaining);
+    }
+}
+
+int dtacqShmValid(const DtacqShmFrame *frame)
+{
+    __sync_synchronize();
+    return frame->pSlot->seq == frame->seq;
+}
+
+uint64_t dtacqShmMissed(const dtacqShmReader *reader)
+{
+    return reader->missed;
+}
+
+const DtacqShmHeader *dtacqShmHeader(const dtacqShmReader *reader)
+{
+    return reader->header;
+}
+
+void dtacqShmClose(dtacqShmReader *reader)
+{
+    if (reader == NULL) return;
+    munmap((void *)reader->header, reader->mapBytes);
+    close(reader->fd);
+    free(reader);
+}
@@ -0,0 +1,117 @@
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "dtacqShmWriter.h"
+
+dtacqShmWriter::dtacqShmWriter()
+    : fd(-1), pBase(NULL), mapBytes(0), header(NULL)
+{
+}
+
+dtacqShmWriter::~dtacqShmWriter()
+{
+    close();
+}
+
+int dtacqShmWriter::open(const char *name, int nSlots, size_t dataCapacity)
+{
+    close();
+    if (name == NULL || name[0] != '/' || nSlots < 1 || dataCapacity == 0) return EINVAL;
+    size_t headerBytes = (sizeof(DtacqShmHeader) + DTACQ_SHM_ALIGN - 1) / DTACQ_SHM_ALIGN * DTACQ_SHM_ALIGN;
+    size_t slotBytes = DTACQ_SHM_SLOT_DATA +
+                       (dataCapacity + DTACQ_SHM_ALIGN - 1) / DTACQ_SHM_ALIGN * DTACQ_SHM_ALIGN;
+    size_t length = headerBytes + (size_t)nSlots * slotBytes;
+    /* Readers of a previous ring of this name keep their mapping; a fresh object is created */
+    shm_unlink(name);
+    int newFd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (newFd < 0) return errno;
+    if (ftruncate(newFd, (off_t)length) != 0) {
+        int err = errno;
+        ::close(newFd);
+        shm_unlink(name);
+        return err;
+    }
+    void *pMap = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, newFd, 0);
+    if (pMap == MAP_FAILED) {
+        int err = errno;
+        ::close(newFd);
+        shm_unlink(name);
+        return err;
+    }
+    this->fd = newFd;
+    this->pBase = pMap;
+    this->mapBytes = length;
+    this->shmName = name;
+    this->header = (DtacqShmHeader *)pMap;
+    /* ftruncate zero fills, so every slot starts with seq 0 (no frame) */
+    this->header->version = DTACQ_SHM_VERSION;
+    this->header->nSlots = nSlots;
+    this->header->headerBytes = (uint32_t)headerBytes;
+    this->header->slotBytes = slotBytes;
+    this->header->dataCapacity = dataCapacity;
+    this->header->head = 0;
+    this->header->writerPid = getpid();
+    __sync_synchronize();
+    this->header->magic = DTACQ_SHM_MAGIC;
+    return 0;
+}
+
+void dtacqShmWriter::close()
+{
+    if (this->header == NULL) return;
+    this->header->closed = 1;
+    __sync_fetch_and_add(&this->header->wake, 1);
+#ifdef __linux__
+    syscall(SYS_futex, &this->header->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+    munmap(this->pBase, this->mapBytes);
+    ::close(this->fd);
+    shm_unlink(this->shmName.c_str());
+    this->header = NULL;
+    this->pBase = NULL;
+    this->fd = -1;
+    this->mapBytes = 0;
+}
+
+bool dtacqShmWriter::publish(DtacqShmFrameInfo *info, const void *pData)
+{
+    if (this->header == NULL || info->dataBytes > this->header->dataCapacity) return false;
+    uint64_t n = this->header->head + 1;
+    DtacqShmSlot *pSlot = (DtacqShmSlot *)((char *)this->pBase + this->header->headerBytes +
+                                           ((n - 1) % this->header->nSlots) * this->header->slotBytes);
+    /* Odd while the slot is being rewritten, so readers still holding the old frame see it change */
+    pSlot->seq = 2 * n + 1;
+    __sync_synchronize();
+    info->frame = n;
+    memcpy(&pSlot->info, info, sizeof(*info));
+    memcpy((char *)pSlot + DTACQ_SHM_SLOT_DATA, pData, info->dataBytes);
+    __sync_synchronize();
+    pSlot->seq = 2 * n;
+    __sync_synchronize();
+    this->header->head = n;
+    __sync_fetch_and_add(&this->header->wake, 1);
+#ifdef __linux__
+    syscall(SYS_futex, &this->header->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+    return true;
+}
+
+void dtacqShmWriter::report(FILE *fp) const
+{
+    if (this->header == NULL) {
+        fprintf(fp, "  Shared memory:     off\n");
+        return;
+    }
+    fprintf(fp, "  Shared memory:     %s, %u slots of %llu bytes, %llu frames written\n",
+            this->shmName.c_str(), this->header->nSlots,
+            (unsigned long long)this->header->dataCapacity, (unsigned long long)this->header->head);
+}
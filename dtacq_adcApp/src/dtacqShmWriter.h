@@ -0,0 +1,39 @@
+#ifndef DTACQSHMWRITER_H
+#define DTACQSHMWRITER_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+
+#include "dtacqShm.h"
+
+/* Writer side of the shared memory frame ring described in dtacqShm.h.
+   publish() copies a frame into the next slot and commits it; it never waits. */
+class dtacqShmWriter {
+public:
+    dtacqShmWriter();
+    ~dtacqShmWriter();
+    /* Create (replacing any stale object of the same name) a ring of nSlots slots of
+       dataCapacity bytes. Returns 0 or an errno value */
+    int open(const char *name, int nSlots, size_t dataCapacity);
+    /* Mark the ring closed for its readers and unlink it */
+    void close();
+    bool isOpen() const { return this->header != NULL; }
+    const char *name() const { return this->shmName.c_str(); }
+    int slots() const { return this->header ? (int)this->header->nSlots : 0; }
+    size_t capacity() const { return this->header ? (size_t)this->header->dataCapacity : 0; }
+    /* Copy info->dataBytes bytes from pData into the next slot. info->frame is filled in.
+       Returns false if the frame does not fit */
+    bool publish(DtacqShmFrameInfo *info, const void *pData);
+    uint64_t frames() const { return this->header ? this->header->head : 0; }
+    void report(FILE *fp) const;
+
+private:
+    std::string shmName;
+    int fd;
+    void *pBase;
+    size_t mapBytes;
+    DtacqShmHeader *header;
+};
+
+#endif /* DTACQSHMWRITER_H */
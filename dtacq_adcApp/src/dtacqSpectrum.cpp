@@ -0,0 +1,135 @@
+#include <math.h>
+#include <string.h>
+
+#include "dtacqSpectrum.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+dtacqSpectrum::dtacqSpectrum()
+    : nFFT(0), nChannels(0), nSegments(0), windowPower(0)
+{
+}
+
+bool dtacqSpectrum::matches(int fftSize, int nChannels) const
+{
+    return fftSize == this->nFFT && nChannels == this->nChannels;
+}
+
+void dtacqSpectrum::reset()
+{
+    this->nSegments = 0;
+    this->sums.assign(this->sums.size(), 0.0);
+}
+
+bool dtacqSpectrum::configure(int fftSize, int nChannels)
+{
+    if (fftSize < 4 || (fftSize & (fftSize - 1)) || nChannels <= 0) return false;
+    this->nFFT = fftSize;
+    this->nChannels = nChannels;
+    this->nSegments = 0;
+    /* Periodic Hann window */
+    this->window.resize(fftSize);
+    this->windowPower = 0;
+    for (int i = 0; i < fftSize; i++) {
+        this->window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / fftSize);
+        this->windowPower += this->window[i] * this->window[i];
+    }
+    this->twiddle.resize(fftSize);
+    for (int i = 0; i < fftSize / 2; i++) {
+        this->twiddle[2 * i] = cos(2 * M_PI * i / fftSize);
+        this->twiddle[2 * i + 1] = -sin(2 * M_PI * i / fftSize);
+    }
+    int bits = 0;
+    while ((1 << bits) < fftSize) bits++;
+    this->bitReverse.resize(fftSize);
+    for (int i = 0; i < fftSize; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++) if (i & (1 << b)) r |= 1 << (bits - 1 - b);
+        this->bitReverse[i] = r;
+    }
+    this->sums.assign((size_t)this->pairs() * 2 * this->bins(), 0.0);
+    return true;
+}
+
+int dtacqSpectrum::segmentsIn(int nRows) const
+{
+    if (this->nFFT == 0 || nRows < this->nFFT) return 0;
+    return (nRows - this->nFFT) / (this->nFFT / 2) + 1;
+}
+
+/* In-place iterative radix-2 FFT of nFFT interleaved complex values, input in bit-reversed order */
+void dtacqSpectrum::transform(double *pData) const
+{
+    int n = this->nFFT;
+    for (int size = 2; size <= n; size *= 2) {
+        int half = size / 2;
+        int step = n / size;
+        for (int start = 0; start < n; start += size) {
+            for (int k = 0; k < half; k++) {
+                double wr = this->twiddle[2 * k * step], wi = this->twiddle[2 * k * step + 1];
+                double *a = pData + 2 * (start + k);
+                double *b = pData + 2 * (start + k + half);
+                double tr = b[0] * wr - b[1] * wi;
+                double ti = b[0] * wi + b[1] * wr;
+                b[0] = a[0] - tr;
+                b[1] = a[1] - ti;
+                a[0] += tr;
+                a[1] += ti;
+            }
+        }
+    }
+}
+
+void dtacqSpectrum::accumulatePair(const double *pFrame, int nRows, int width, int pair,
+                                   std::vector<double> *scratch)
+{
+    int n = this->nFFT;
+    int nBins = this->bins();
+    int first = 2 * pair;
+    bool second = (first + 1 < this->nChannels);
+    if (scratch->size() < (size_t)2 * n) scratch->resize(2 * n);
+    double *z = &(*scratch)[0];
+    double *sumX = &this->sums[(size_t)first * nBins];
+    double *sumY = sumX + nBins;
+    int nSeg = segmentsIn(nRows);
+    for (int seg = 0; seg < nSeg; seg++) {
+        /* Load x + iy, windowed, straight into bit-reversed order */
+        const double *pRow = pFrame + (size_t)seg * (n / 2) * width + first;
+        for (int i = 0; i < n; i++, pRow += width) {
+            double *zi = z + 2 * this->bitReverse[i];
+            zi[0] = pRow[0] * this->window[i];
+            zi[1] = second ? pRow[1] * this->window[i] : 0.0;
+        }
+        transform(z);
+        /* Separate the two real spectra: X = (Z[k] + conj Z[n-k]) / 2, Y = (Z[k] - conj Z[n-k]) / 2i */
+        for (int k = 0; k < nBins; k++) {
+            int m = (n - k) & (n - 1);
+            double zr = z[2 * k], zi = z[2 * k + 1];
+            double cr = z[2 * m], ci = -z[2 * m + 1];
+            double xr = 0.5 * (zr + cr), xi = 0.5 * (zi + ci);
+            double yr = 0.5 * (zi - ci), yi = -0.5 * (zr - cr);
+            sumX[k] += xr * xr + xi * xi;
+            if (second) sumY[k] += yr * yr + yi * yi;
+        }
+    }
+}
+
+void dtacqSpectrum::average(double sampleRate, double *pOut)
+{
+    int nBins = this->bins();
+    double fs = (sampleRate > 0) ? sampleRate : 1.0;
+    double scale = (this->nSegments > 0) ? 1.0 / (this->nSegments * fs * this->windowPower) : 0.0;
+    for (int c = 0; c < this->nChannels; c++) {
+        const double *pSum = &this->sums[(size_t)c * nBins];
+        double *pPsd = pOut + (size_t)c * nBins;
+        for (int k = 0; k < nBins; k++) {
+            /* One-sided: every bin but DC and Nyquist also carries the negative frequency */
+            double weight = (k == 0 || k == nBins - 1) ? 1.0 : 2.0;
+            pPsd[k] = pSum[k] * scale * weight;
+        }
+    }
+    this->sums.assign(this->sums.size(), 0.0);
+    this->nSegments = 0;
+}
@@ -0,0 +1,45 @@
+#ifndef DTACQSPECTRUM_H
+#define DTACQSPECTRUM_H
+
+#include <vector>
+
+/* Welch power spectral density estimate for every channel of NDFloat64 frames.
+
+   Each frame is cut into segments of fftSize samples overlapping by half, each
+   segment is multiplied by a Hann window and transformed, and the periodograms are
+   summed per channel until average() is called. Two real channels are transformed
+   with one complex FFT. accumulatePair() only touches its own pair's sums, so pairs
+   can be processed on separate threads. */
+class dtacqSpectrum {
+public:
+    dtacqSpectrum();
+    /* fftSize must be a power of two, at least 4. Clears the sums */
+    bool configure(int fftSize, int nChannels);
+    bool matches(int fftSize, int nChannels) const;
+    int fftSize() const { return this->nFFT; }
+    int bins() const { return this->nFFT / 2 + 1; }
+    int pairs() const { return (this->nChannels + 1) / 2; }
+    /* Number of Welch segments in a frame of nRows samples */
+    int segmentsIn(int nRows) const;
+    /* Add the periodograms of channels 2*pair and 2*pair+1 of a frame of nRows rows of
+       width values. scratch is per-thread working space */
+    void accumulatePair(const double *pFrame, int nRows, int width, int pair, std::vector<double> *scratch);
+    /* Count the segments of a frame once all its pairs have been accumulated */
+    void addFrame(int nRows) { this->nSegments += segmentsIn(nRows); }
+    int segments() const { return this->nSegments; }
+    /* Discard the partial average */
+    void reset();
+    /* Write the averaged one-sided PSD (units^2/Hz; per bin if sampleRate is 0) as
+       nChannels rows of bins() values into pOut, then clear the sums */
+    void average(double sampleRate, double *pOut);
+
+private:
+    void transform(double *pData) const;
+    int nFFT, nChannels, nSegments;
+    double windowPower;
+    std::vector<double> window, twiddle;
+    std::vector<int> bitReverse;
+    std::vector<double> sums;
+};
+
+#endif /* DTACQSPECTRUM_H */
@@ -0,0 +1,162 @@
+#include <stdio.h>
+
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsStdio.h>
+
+#include "dtacqWorkerPool.h"
+
+struct workerStart {
+    dtacqWorkerPool *pool;
+    int worker;
+};
+
+static void workerThreadC(void *drvPvt)
+{
+    workerStart *pStart = (workerStart *)drvPvt;
+    dtacqWorkerPool *pool = pStart->pool;
+    int worker = pStart->worker;
+    delete pStart;
+    pool->workerThread(worker);
+}
+
+/* Create a pool of nThreads threads named <name>-<n> with the given EPICS priority and
+   stack size. The thread calling run() also executes tasks, so nThreads may be 0 to run
+   everything on the caller. Errors are reported through pasynUser's trace */
+dtacqWorkerPool::dtacqWorkerPool(const char *name, int nThreads, unsigned int priority, unsigned int stackSize,
+                                 asynUser *pasynUser)
+    : pasynUser(pasynUser), func(NULL), arg(NULL), nTasks(0), nextTask(0), pending(0),
+      scheduleGeneration(0), failures(0), latencySum(0.0), latencyMax(0.0), latencyCount(0)
+{
+    dtacqSetSchedule(&this->schedule, 0, NULL);
+    char threadName[64];
+    if (nThreads < 0) nThreads = 0;
+    this->workers.resize(nThreads);
+    for (int i = 0; i < nThreads; i++) this->workers[i] = new epicsEvent();
+    for (int i = 0; i < nThreads; i++) {
+        workerStart *pStart = new workerStart;
+        pStart->pool = this;
+        pStart->worker = i;
+        epicsSnprintf(threadName, sizeof(threadName), "%s-%d", name, i);
+        if (epicsThreadCreate(threadName, priority, stackSize,
+                              (EPICSTHREADFUNC)workerThreadC, pStart) == NULL) {
+            asynPrint(this->pasynUser, ASYN_TRACE_ERROR,
+                      "dtacqWorkerPool: epicsThreadCreate failure for %s\n", threadName);
+            delete pStart;
+        }
+    }
+}
+
+int dtacqWorkerPool::size() const
+{
+    return (int)this->workers.size() + 1;
+}
+
+void dtacqWorkerPool::run(taskFunc func, void *arg, int nTasks)
+{
+    if (nTasks <= 0) return;
+    this->mutex.lock();
+    this->func = func;
+    this->arg = arg;
+    this->nTasks = nTasks;
+    this->nextTask = 0;
+    this->pending = nTasks;
+    epicsTimeGetCurrent(&this->dispatchTime);
+    this->mutex.unlock();
+    /* No point waking more workers than there are tasks for */
+    for (size_t i = 0; i < this->workers.size() && (int)i < nTasks - 1; i++)
+        this->workers[i]->signal();
+    /* The caller is the last worker */
+    doTasks((int)this->workers.size());
+    while (1) {
+        this->mutex.lock();
+        int remaining = this->pending;
+        this->mutex.unlock();
+        if (remaining == 0) break;
+        this->done.wait();
+    }
+}
+
+void dtacqWorkerPool::doTasks(int worker)
+{
+    while (1) {
+        this->mutex.lock();
+        if (this->nextTask >= this->nTasks) {
+            this->mutex.unlock();
+            return;
+        }
+        int task = this->nextTask++;
+        taskFunc func = this->func;
+        void *arg = this->arg;
+        this->mutex.unlock();
+        func(arg, task, worker);
+        this->mutex.lock();
+        bool last = (--this->pending == 0);
+        this->mutex.unlock();
+        if (last) this->done.signal();
+    }
+}
+
+void dtacqWorkerPool::setSchedule(const DtacqSchedule *schedule)
+{
+    this->mutex.lock();
+    this->schedule = *schedule;
+    this->scheduleGeneration++;
+    this->mutex.unlock();
+}
+
+void dtacqWorkerPool::getLatency(double *mean, double *max)
+{
+    this->mutex.lock();
+    *mean = this->latencyCount ? this->latencySum / this->latencyCount : 0.0;
+    *max = this->latencyMax;
+    this->mutex.unlock();
+}
+
+void dtacqWorkerPool::resetLatency()
+{
+    this->mutex.lock();
+    this->latencySum = 0.0;
+    this->latencyMax = 0.0;
+    this->latencyCount = 0;
+    this->mutex.unlock();
+}
+
+int dtacqWorkerPool::scheduleFailures()
+{
+    this->mutex.lock();
+    int failures = this->failures;
+    this->mutex.unlock();
+    return failures;
+}
+
+void dtacqWorkerPool::workerThread(int worker)
+{
+    int applied = 0;
+    while (1) {
+        this->workers[worker]->wait();
+        epicsTimeStamp now;
+        epicsTimeGetCurrent(&now);
+        this->mutex.lock();
+        double latency = epicsTimeDiffInSeconds(&now, &this->dispatchTime) * 1.e6;
+        this->latencySum += latency;
+        this->latencyCount++;
+        if (latency > this->latencyMax) this->latencyMax = latency;
+        bool reschedule = (applied != this->scheduleGeneration);
+        DtacqSchedule schedule = this->schedule;
+        applied = this->scheduleGeneration;
+        this->mutex.unlock();
+        if (reschedule) {
+            char message[128];
+            if (dtacqApplySchedule(&schedule, message, sizeof(message))) {
+                asynPrint(this->pasynUser, ASYN_TRACE_ERROR, "dtacqWorkerPool: worker %d: %s\n",
+                          worker, message);
+                this->mutex.lock();
+                this->failures++;
+                this->mutex.unlock();
+            }
+        }
+        doTasks(worker);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef DTACQWORKERPOOL_H
+#define DTACQWORKERPOOL_H
+
+#include <vector>
+
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsTime.h>
+#include <asynDriver.h>
+
+#include "dtacqRealtime.h"
+
+/* A fixed pool of threads used to spread per-frame processing over several cores.
+   run() hands out task indices 0..nTasks-1 to the workers and to the calling thread,
+   and returns once every task has completed. Only one run() may be active at a time. */
+class dtacqWorkerPool {
+public:
+    /* func(arg, task, worker): worker is in [0, size()) and identifies the thread, so
+       tasks can keep per-thread scratch space */
+    typedef void (*taskFunc)(void *arg, int task, int worker);
+
+    dtacqWorkerPool(const char *name, int nThreads, unsigned int priority, unsigned int stackSize,
+                    asynUser *pasynUser);
+    void run(taskFunc func, void *arg, int nTasks);
+    /* Number of threads that may execute tasks, including the caller of run() */
+    int size() const;
+    /* Change the scheduling of the worker threads; each applies it the next time it wakes */
+    void setSchedule(const DtacqSchedule *schedule);
+    /* Time from run() handing out tasks to a worker starting on them, in microseconds.
+       The mean covers the calls since the last resetLatency() */
+    void getLatency(double *mean, double *max);
+    void resetLatency();
+    int scheduleFailures();
+    void workerThread(int worker);
+
+private:
+    void doTasks(int worker);
+    asynUser *pasynUser;
+    /* One event per worker thread, signalled when there are tasks to pick up */
+    std::vector<epicsEvent *> workers;
+    epicsMutex mutex;
+    epicsEvent done;
+    taskFunc func;
+    void *arg;
+    int nTasks;
+    int nextTask;
+    int pending;
+    epicsTimeStamp dispatchTime;
+    DtacqSchedule schedule;
+    int scheduleGeneration;
+    int failures;
+    double latencySum, latencyMax;
+    int latencyCount;
+};
+
+#endif /* DTACQWORKERPOOL_H */
@@ -13,6 +13,7 @@
 
 #include <map>
 #include <vector>
+#include <algorithm>
 #include <stdexcept>
 
 #include <iostream>
@@ -34,6 +35,15 @@
 #include <epicsExport.h>
 
 #include "dtacq_adc.h"
+#include "dtacqCompress.h"
+#include "dtacqWorkerPool.h"
+#include "dtacqArena.h"
+#include "dtacqBacklog.h"
+#include "dtacqKernels.h"
+#include "dtacqSampleRing.h"
+#include "dtacqSpectrum.h"
+#include "dtacqShmWriter.h"
+#include "dtacqFrameSizer.h"
 
 asynCommon *pasynCommon;
 
@@ -46,6 +56,24 @@ static void dtacqTaskC(void *drvPvt)
     pPvt->dtacqTask();
 }
 
+static void compressBlockC(void *drvPvt, int block, int worker)
+{
+    dtacq_adc *pPvt = (dtacq_adc *)drvPvt;
+    pPvt->compressBlock(block, worker);
+}
+
+static void spectrumPairC(void *drvPvt, int pair, int worker)
+{
+    dtacq_adc *pPvt = (dtacq_adc *)drvPvt;
+    pPvt->spectrumPair(pair, worker);
+}
+
+static void commandDoneC(void *drvPvt, const DtacqCommand *command)
+{
+    dtacq_adc *pPvt = (dtacq_adc *)drvPvt;
+    pPvt->commandDone(command);
+}
+
 /* Constructor for dtacq_adc; most parameters are simply passed to
    ADDriver::ADDriver. After calling the base class constructor this method
    creates a thread to read the detector data, and sets
@@ -64,16 +92,17 @@ static void dtacqTaskC(void *drvPvt)
                         for this driver is allowed to allocate. Set this to
                         -1 to allow an unlimited amount of memory.
    \param[in] dataHostInfo
-   \param[in] priority The thread priority for the asyn port driver thread
-                       if ASYN_CANBLOCK is set in asynFlags.
-   \param[in] stackSize The stack size for the asyn port driver thread if
-                        ASYN_CANBLOCK is set in asynFlags.
+   \param[in] priority The EPICS thread priority for the acquisition and worker
+                       threads, 0 for epicsThreadPriorityMedium.
+   \param[in] stackSize The stack size for the acquisition thread, 0 for
+                        epicsThreadStackMedium.
 */
 dtacq_adc::dtacq_adc(const char *portName, const char *dataPortName, const char *controlPortName,
                      int nChannels, int moduleType, int nSamples, int maxBuffers, size_t maxMemory,
                      const char *dataHostInfo, int priority, int stackSize)
-    : ADDriver(portName, 1, DTACQ_NUM_PARAMETERS, maxBuffers, maxMemory, asynEnumMask, asynEnumMask,
-               0, 1, priority, stackSize), pRaw(NULL)
+    : ADDriver(portName, DTACQ_NUM_ADDR, DTACQ_NUM_PARAMETERS, maxBuffers, maxMemory,
+               asynEnumMask | asynFloat64ArrayMask, asynEnumMask | asynFloat64ArrayMask,
+               ASYN_MULTIDEVICE, 1, priority, stackSize), pRaw(NULL)
 {
     int status = asynSuccess;
     const char *functionName = "dtacq_adc";
@@ -81,6 +110,7 @@ dtacq_adc::dtacq_adc(const char *portName, const char *dataPortName, const char
     strncpy(this->dataHostInfo, dataHostInfo, STRINGLEN);
     strncpy(this->dataPortName, dataPortName, STRINGLEN);
     this->moduleType = moduleType;
+    this->count2volt = 0;
     /* Create the epicsEvents for signaling to the simulate task when acquisition starts and stops */
     acquireStartEvent = new epicsEvent();
     acquireStopEvent = new epicsEvent();
@@ -91,6 +121,80 @@ dtacq_adc::dtacq_adc(const char *portName, const char *dataPortName, const char
     createParam("AGGR_SITES", asynParamOctet, &DtacqAggregationSites);
     createParam("USE_SAMPLE_COUNT", asynParamInt32, &DtacqEnableScratchpad);
     createParam("BAD_ARRAY", asynParamInt32, &DtacqBadFrames);
+    createParam(DtacqOverflowPolicyString, asynParamInt32, &DtacqOverflowPolicy);
+    createParam(DtacqDroppedFramesString, asynParamInt32, &DtacqDroppedFrames);
+    createParam(DtacqDroppedBytesString, asynParamFloat64, &DtacqDroppedBytes);
+    createParam(DtacqDroppedSamplesString, asynParamFloat64, &DtacqDroppedSamples);
+    createParam(DtacqRawFramesString, asynParamInt32, &DtacqRawFrames);
+    createParam(DtacqChunkSamplesString, asynParamInt32, &DtacqChunkSamples);
+    createParam(DtacqChunkAssembleString, asynParamInt32, &DtacqChunkAssemble);
+    createParam(DtacqCalSourceString, asynParamInt32, &DtacqCalSource);
+    createParam(DtacqCalFileString, asynParamOctet, &DtacqCalFile);
+    createParam(DtacqCalChannelsString, asynParamInt32, &DtacqCalChannels);
+    createParam(DtacqInvertMaskString, asynParamInt32, &DtacqInvertMask);
+    createParam(DtacqReplayModeString, asynParamInt32, &DtacqReplayMode);
+    createParam(DtacqReplayFileString, asynParamOctet, &DtacqReplayFile);
+    createParam(DtacqReplayRateString, asynParamFloat64, &DtacqReplayRate);
+    createParam(DtacqReplayLoopString, asynParamInt32, &DtacqReplayLoop);
+    createParam(DtacqCompressString, asynParamInt32, &DtacqCompress);
+    createParam(DtacqCompressVerifyString, asynParamInt32, &DtacqCompressVerify);
+    createParam(DtacqCompressRatioString, asynParamFloat64, &DtacqCompressRatio);
+    createParam(DtacqCompressErrorsString, asynParamInt32, &DtacqCompressErrors);
+    createParam(DtacqAlignCheckString, asynParamInt32, &DtacqAlignCheck);
+    createParam(DtacqMisalignedString, asynParamInt32, &DtacqMisaligned);
+    createParam(DtacqAlignSlipString, asynParamInt32, &DtacqAlignSlip);
+    createParam(DtacqDemuxSitesString, asynParamInt32, &DtacqDemuxSites);
+    createParam(DtacqSiteNumberString, asynParamInt32, &DtacqSiteNumber);
+    createParam(DtacqSiteModuleString, asynParamInt32, &DtacqSiteModule);
+    createParam(DtacqSiteChannelsString, asynParamInt32, &DtacqSiteChannels);
+    createParam(DtacqSchedStatusString, asynParamOctet, &DtacqSchedStatus);
+    createParam(DtacqReaderLatencyString, asynParamFloat64, &DtacqReaderLatency);
+    createParam(DtacqWorkerLatencyString, asynParamFloat64, &DtacqWorkerLatency);
+    createParam(DtacqWorkerLatencyMaxString, asynParamFloat64, &DtacqWorkerLatencyMax);
+    createParam(DtacqActualSampleRateString, asynParamFloat64, &DtacqActualSampleRate);
+    createParam(DtacqSocketBacklogString, asynParamFloat64, &DtacqSocketBacklog);
+    createParam(DtacqBacklogFillString, asynParamFloat64, &DtacqBacklogFill);
+    createParam(DtacqConsumedRateString, asynParamFloat64, &DtacqConsumedRate);
+    createParam(DtacqExpectedRateString, asynParamFloat64, &DtacqExpectedRate);
+    createParam(DtacqHeadroomString, asynParamFloat64, &DtacqHeadroom);
+    createParam(DtacqOverrunTimeString, asynParamFloat64, &DtacqOverrunTime);
+    createParam(DtacqOverrunWarnTimeString, asynParamFloat64, &DtacqOverrunWarnTime);
+    createParam(DtacqOverrunPredictedString, asynParamInt32, &DtacqOverrunPredicted);
+    createParam(DtacqWindowLengthString, asynParamInt32, &DtacqWindowLength);
+    createParam(DtacqWindowHopString, asynParamInt32, &DtacqWindowHop);
+    createParam(DtacqWindowCountString, asynParamInt32, &DtacqWindowCount);
+    createParam(DtacqWindowDroppedString, asynParamInt32, &DtacqWindowDropped);
+    createParam(DtacqFftSizeString, asynParamInt32, &DtacqFftSize);
+    createParam(DtacqFftAveragesString, asynParamInt32, &DtacqFftAverages);
+    createParam(DtacqFftChannelString, asynParamInt32, &DtacqFftChannel);
+    createParam(DtacqFftCountString, asynParamInt32, &DtacqFftCount);
+    createParam(DtacqFftFreqStepString, asynParamFloat64, &DtacqFftFreqStep);
+    createParam(DtacqFftFreqString, asynParamFloat64Array, &DtacqFftFreq);
+    createParam(DtacqFftPsdString, asynParamFloat64Array, &DtacqFftPsd);
+    createParam(DtacqCmdPendingString, asynParamInt32, &DtacqCmdPending);
+    createParam(DtacqCmdCountString, asynParamInt32, &DtacqCmdCount);
+    createParam(DtacqCmdCoalescedString, asynParamInt32, &DtacqCmdCoalesced);
+    createParam(DtacqCmdErrorsString, asynParamInt32, &DtacqCmdErrors);
+    createParam(DtacqCmdLatencyString, asynParamFloat64, &DtacqCmdLatency);
+    createParam(DtacqCmdLatencyMeanString, asynParamFloat64, &DtacqCmdLatencyMean);
+    createParam(DtacqCmdLatencyMaxString, asynParamFloat64, &DtacqCmdLatencyMax);
+    createParam(DtacqCmdResetString, asynParamInt32, &DtacqCmdReset);
+    createParam(DtacqSpadWordsString, asynParamInt32, &DtacqSpadWords);
+    createParam(DtacqSpadDixString, asynParamInt32, &DtacqSpadDix);
+    createParam(DtacqShmNameString, asynParamOctet, &DtacqShmName);
+    createParam(DtacqShmSlotsString, asynParamInt32, &DtacqShmSlots);
+    createParam(DtacqShmSlotMBString, asynParamInt32, &DtacqShmSlotMB);
+    createParam(DtacqShmSourceString, asynParamInt32, &DtacqShmSource);
+    createParam(DtacqShmFramesString, asynParamInt32, &DtacqShmFrames);
+    createParam(DtacqShmDroppedString, asynParamInt32, &DtacqShmDropped);
+    createParam(DtacqShmStatusString, asynParamOctet, &DtacqShmStatus);
+    createParam(DtacqAdaptModeString, asynParamInt32, &DtacqAdaptMode);
+    createParam(DtacqAdaptTargetString, asynParamFloat64, &DtacqAdaptTarget);
+    createParam(DtacqAdaptMinString, asynParamInt32, &DtacqAdaptMin);
+    createParam(DtacqAdaptMaxString, asynParamInt32, &DtacqAdaptMax);
+    createParam(DtacqAdaptSamplesString, asynParamInt32, &DtacqAdaptSamples);
+    createParam(DtacqAdaptRateString, asynParamFloat64, &DtacqAdaptRate);
+    createParam(DtacqPipelineTimeString, asynParamFloat64, &DtacqPipelineTime);
 
     /* Set some default values for parameters */
     status = setIntegerParam(ADMaxSizeX, nChannels);
@@ -107,9 +211,99 @@ dtacq_adc::dtacq_adc(const char *portName, const char *dataPortName, const char
     status |= setIntegerParam(DtacqChannels, nChannels);
     status |= setIntegerParam(DtacqEnableScratchpad, 0);
     status |= setIntegerParam(DtacqBadFrames, 0);
+    status |= setIntegerParam(DtacqOverflowPolicy, DtacqDropNewest);
+    status |= setIntegerParam(DtacqDroppedFrames, 0);
+    status |= setDoubleParam(DtacqDroppedBytes, 0.0);
+    status |= setDoubleParam(DtacqDroppedSamples, 0.0);
+    status |= setIntegerParam(DtacqRawFrames, 0);
+    status |= setIntegerParam(DtacqChunkSamples, 0);
+    status |= setIntegerParam(DtacqChunkAssemble, 1);
+    status |= setIntegerParam(DtacqCalSource, DtacqCalNone);
+    status |= setStringParam(DtacqCalFile, "");
+    status |= setIntegerParam(DtacqCalChannels, 0);
+    status |= setIntegerParam(DtacqAdcInvert, 0);
+    status |= setIntegerParam(DtacqInvertMask, 0);
+    status |= setIntegerParam(DtacqReplayMode, DtacqReplayOff);
+    status |= setStringParam(DtacqReplayFile, "");
+    status |= setDoubleParam(DtacqReplayRate, 0.0);
+    status |= setIntegerParam(DtacqReplayLoop, 0);
+    status |= setIntegerParam(DtacqCompress, 0);
+    status |= setIntegerParam(DtacqCompressVerify, 0);
+    status |= setDoubleParam(DtacqCompressRatio, 0.0);
+    status |= setIntegerParam(DtacqCompressErrors, 0);
+    status |= setIntegerParam(DtacqAlignCheck, 0);
+    status |= setIntegerParam(DtacqMisaligned, 0);
+    status |= setIntegerParam(DtacqAlignSlip, 0);
+    status |= setIntegerParam(DtacqDemuxSites, 0);
+    status |= setStringParam(DtacqSchedStatus, "Default scheduling");
+    status |= setDoubleParam(DtacqReaderLatency, 0.0);
+    status |= setDoubleParam(DtacqWorkerLatency, 0.0);
+    status |= setDoubleParam(DtacqWorkerLatencyMax, 0.0);
+    status |= setDoubleParam(DtacqActualSampleRate, 0.0);
+    status |= setDoubleParam(DtacqOverrunWarnTime, 10.0);
+    status |= setIntegerParam(DtacqWindowLength, 0);
+    status |= setIntegerParam(DtacqWindowHop, 0);
+    status |= setIntegerParam(DtacqWindowCount, 0);
+    status |= setIntegerParam(DtacqWindowDropped, 0);
+    status |= setIntegerParam(DtacqFftSize, 0);
+    status |= setIntegerParam(DtacqFftAverages, 1);
+    status |= setIntegerParam(DtacqFftChannel, 1);
+    status |= setIntegerParam(DtacqFftCount, 0);
+    status |= setDoubleParam(DtacqFftFreqStep, 0.0);
+    status |= setIntegerParam(DtacqCmdPending, 0);
+    status |= setIntegerParam(DtacqCmdCount, 0);
+    status |= setIntegerParam(DtacqCmdCoalesced, 0);
+    status |= setIntegerParam(DtacqCmdErrors, 0);
+    status |= setDoubleParam(DtacqCmdLatency, 0.0);
+    status |= setDoubleParam(DtacqCmdLatencyMean, 0.0);
+    status |= setDoubleParam(DtacqCmdLatencyMax, 0.0);
+    status |= setIntegerParam(DtacqCmdReset, 0);
+    status |= setIntegerParam(DtacqSpadWords, 1);
+    status |= setIntegerParam(DtacqSpadDix, 0);
+    status |= setStringParam(DtacqShmName, "");
+    status |= setIntegerParam(DtacqShmSlots, 4);
+    status |= setIntegerParam(DtacqShmSlotMB, 0);
+    status |= setIntegerParam(DtacqShmSource, DtacqShmConverted);
+    status |= setIntegerParam(DtacqShmFrames, 0);
+    status |= setIntegerParam(DtacqShmDropped, 0);
+    status |= setStringParam(DtacqShmStatus, "Off");
+    status |= setIntegerParam(DtacqAdaptMode, DtacqAdaptOff);
+    status |= setDoubleParam(DtacqAdaptTarget, 0.1);
+    status |= setIntegerParam(DtacqAdaptMin, 64);
+    status |= setIntegerParam(DtacqAdaptMax, 0);
+    status |= setIntegerParam(DtacqAdaptSamples, nSamples);
+    status |= setDoubleParam(DtacqAdaptRate, 0.0);
+    status |= setDoubleParam(DtacqPipelineTime, 0.0);
+    dataSocket = -1;
+    resetBacklog();
+    for (int s = 0; s < DTACQ_MAX_SITES; s++) {
+        status |= setIntegerParam(DTACQ_SITE_ADDR + s, DtacqSiteNumber, 0);
+        status |= setIntegerParam(DTACQ_SITE_ADDR + s, DtacqSiteModule, 0);
+        status |= setIntegerParam(DTACQ_SITE_ADDR + s, DtacqSiteChannels, 0);
+    }
 
     sampleCount = 0;
+    chunkCounter = 0;
+    publishFrame = true;
+    commonDataIPPort = octetDataIPPort = NULL;
+    acquireGeneration = 0;
+    replayMode = DtacqReplayOff;
+    replayFile = NULL;
+    replayEnded = false;
+    replayLoop = 0;
+    replayRate = 0;
+    replaySamples = 0;
+    frameSkip = 0;
+    dtacqSetLayout(&frameLayout, 4, nChannels, 0, 0);
+    realignWords = 0;
+    idCheckUsable = false;
+    dtacqSetSchedule(&readerSchedule, 0, NULL);
+    readerScheduleGeneration = 0;
+    readerScheduleApplied = 0;
+    droppedBytes = 0;
+    droppedSamples = 0;
     cleanSampleSeen = false;
+    commandQueue = NULL;
 
     if (status) {
 	asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s: unable to set camera parameters\n", functionName);
@@ -124,10 +318,43 @@ dtacq_adc::dtacq_adc(const char *portName, const char *dataPortName, const char
     ranges.insert(std::pair<int, std::vector<double> >(ACQ420, gains)); // ACQ420FMC
     ranges.insert(std::pair<int, std::vector<double> >(ACQ425, gains)); // ACQ425ELF
     ranges.insert(std::pair<int, std::vector<double> >(ACQ437, gains)); // ACQ437ELF
+    /* Size the per-channel scaling tables; they are filled in properly by postInitConfig */
+    updateCalibration();
+    /* Worker threads for per-frame processing that can be split up, e.g. compression */
+    /* priority and stackSize apply to the acquisition and worker threads; 0 selects the defaults.
+       SCHED_FIFO and CPU affinity are set separately, see setScheduling() */
+    unsigned int taskPriority = (priority > 0) ? priority : epicsThreadPriorityMedium;
+    unsigned int taskStackSize = (stackSize > 0) ? stackSize : epicsThreadGetStackSize(epicsThreadStackMedium);
+    workerPool = new dtacqWorkerPool("D-TACQWorker", DTACQ_NUM_WORKERS, taskPriority, taskStackSize,
+                                     this->pasynUserSelf);
+    workerScratch.resize(workerPool->size());
+    /* Memory for the largest raw frame: nSamples rows of nChannels 32 bit words plus the
+       largest scratchpad (DTACQ_MAX_SPAD_WORDS 32 bit words, whatever the data type) */
+    size_t arenaDims[2];
+    arenaDims[0] = nChannels + DTACQ_MAX_SPAD_WORDS;
+    arenaDims[1] = nSamples;
+    rawArena = new dtacqArena(arenaDims[0] * arenaDims[1] * sizeof(epicsInt32), this->pasynUserSelf);
+    pArenaArray = NULL;
+    if (rawArena->base())
+        pArenaArray = this->pNDArrayPool->alloc(2, arenaDims, NDInt32, rawArena->size(), rawArena->base());
+    faultBaseMinor = faultBaseMajor = 0;
+    windowRing = new dtacqSampleRing(this->pNDArrayPool, DTACQ_WINDOW_SHELLS, DTACQ_WINDOW_RING);
+    windowCounter = 0;
+    spectrum = new dtacqSpectrum();
+    spectrumFrames = 0;
+    spectrumReset = false;
+    spectrumCounter = 0;
+    spectrumFrame = NULL;
+    spectrumRows = spectrumWidth = 0;
+    spectrumScratch.resize(workerPool->size());
+    shmWriter = new dtacqShmWriter();
+    frameSizer = new dtacqFrameSizer();
+    lastReadValid = false;
+    readerMinorFaults = readerMajorFaults = 0;
     /* Create the thread that updates the images */
     status = (epicsThreadCreate("D-TACQTask",
-                                epicsThreadPriorityMedium,
-                                epicsThreadGetStackSize(epicsThreadStackMedium),
+                                taskPriority,
+                                taskStackSize,
                                 (EPICSTHREADFUNC)dtacqTaskC,
                                 this) == NULL);
     if (status) {
@@ -138,6 +365,10 @@ dtacq_adc::dtacq_adc(const char *portName, const char *dataPortName, const char
     status = pasynOctetSyncIO->connect(controlPortName, -1, &this->controlIPPort, NULL);
     if (status)
       asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s failed to connect asyn to control port\n", driverName, functionName);
+    /* Nothing the command thread does is time critical, so it runs at the default priority and
+       is left out of setScheduling() */
+    commandQueue = new dtacqCommandQueue(controlPortName, 2.0, calBufferSize, epicsThreadPriorityMedium,
+                                         taskStackSize, commandDoneC, this, this->pasynUserSelf);
     status = drvAsynIPPortConfigure(this->dataPortName, this->dataHostInfo, 0, 1, 0);
     if (status)
       asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s failed to configure data port\n", driverName, functionName);
@@ -160,6 +391,7 @@ int dtacq_adc::postInitConfig()
 	asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s failed to calculate the voltage range conversion factor, count2volt=%f\n",
             driverName, functionName, count2volt);
     }
+    updateCalibration();
     /* Blank out the gain selection menu for an ACQ420FMC */
     if (this->moduleType == 1) {
         for (int i = 0; i < this->ngvals; ++i) {
@@ -175,7 +407,11 @@ int dtacq_adc::postInitConfig()
     int scratch;
     getIntegerParam(DtacqEnableScratchpad, &scratch);
     if (scratch) {
-	this->setDeviceParameter("spad", "1,1,0", NULL);
+	DtacqFrameLayout layout;
+	char command[32];
+	getFrameLayout(4, &layout);
+	epicsSnprintf(command, sizeof(command), "1,%d,%d", layout.spadWords, layout.dix);
+	this->setDeviceParameter("spad", command, NULL);
     }
 
     return status;
@@ -183,12 +419,14 @@ int dtacq_adc::postInitConfig()
 
 
 
-/* Reads a raw frame from the data stream on port 4210 */
-int dtacq_adc::readArray(int n_samples, int n_channels, int nBytes)
+/* Reads a raw frame from the data stream on port 4210 into pData */
+int dtacq_adc::readArray(char *pData, int n_samples, int n_channels, int nBytes)
 {
     int status = asynSuccess;
     size_t nread = 0;
     int eomReason, connected, totalRead = 0;
+    if (this->replayMode != DtacqReplayOff)
+        return readReplay(pData, n_samples, (size_t)n_samples * n_channels * nBytes);
     status = pasynManager->isConnected(this->commonDataIPPort, &connected);
     if (!status) {
 	if (connected) {
@@ -197,7 +435,7 @@ int dtacq_adc::readArray(int n_samples, int n_channels, int nBytes)
 	    while (totalRead < n_samples * (n_channels * nBytes)) {
 		status = pasynOctetSyncIO->read(
 		    this->octetDataIPPort,
-		    (char *) this->pRaw->pData + totalRead,
+		    pData + totalRead,
 		    n_samples*(n_channels*nBytes) - totalRead,
 		    5.0, &nread, &eomReason);
 		if (nread == 0) {
@@ -208,6 +446,17 @@ int dtacq_adc::readArray(int n_samples, int n_channels, int nBytes)
 		    break;
 		}
 		totalRead += nread;
+		this->bytesConsumed += nread;
+		/* Sample the receive queue during long frames too, not only between them */
+		epicsTimeStamp now;
+		epicsTimeGetCurrent(&now);
+		if (epicsTimeDiffInSeconds(&now, &this->readSampleTime) >= DTACQ_BACKLOG_INTERVAL) {
+		    this->readSampleTime = now;
+		    this->lock();
+		    updateBacklog();
+		    callParamCallbacks();
+		    this->unlock();
+		}
 	    }
 
 	    if (status != asynSuccess) {
@@ -224,18 +473,292 @@ int dtacq_adc::readArray(int n_samples, int n_channels, int nBytes)
     return status;
 }
 
+/* Reads the next nBytes from a recorded data port capture instead of the socket, looping
+   at the end of the file if requested and, in paced mode, sleeping so that samples are
+   delivered no faster than the configured sample rate.
+   NOTE: The caller of this function must NOT hold the mutex */
+int dtacq_adc::readReplay(char *pData, int n_samples, size_t nBytes)
+{
+    const char *functionName = "readReplay";
+    size_t totalRead = 0;
+    bool rewound = false;
+    this->replayMutex.lock();
+    while (totalRead < nBytes) {
+        if (this->replayFile == NULL) {
+            this->replayMutex.unlock();
+            return asynDisconnected;
+        }
+        size_t nread = fread(pData + totalRead, 1, nBytes - totalRead, this->replayFile);
+        totalRead += nread;
+        if (totalRead == nBytes) break;
+        if (ferror(this->replayFile)) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s error reading replay file: %s\n",
+                      driverName, functionName, strerror(errno));
+            this->replayMutex.unlock();
+            return asynError;
+        }
+        /* End of file; a partial frame at the end of the capture is discarded. Having
+           rewound already, the whole capture is shorter than a frame and looping cannot help */
+        if (!this->replayLoop || rewound) {
+            if (rewound)
+                asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                          "%s:%s replay file is shorter than one frame (%lu bytes)\n",
+                          driverName, functionName, (unsigned long)nBytes);
+            this->replayEnded = true;
+            this->replayMutex.unlock();
+            return asynDisconnected;
+        }
+        rewind(this->replayFile);
+        rewound = true;
+        totalRead = 0;
+    }
+    this->replayMutex.unlock();
+    if (this->replayMode == DtacqReplayPaced && this->replayRate > 0) {
+        epicsTimeStamp now;
+        this->replaySamples += n_samples;
+        epicsTimeGetCurrent(&now);
+        double ahead = this->replaySamples / this->replayRate - epicsTimeDiffInSeconds(&now, &this->replayStart);
+        if (ahead > 0) epicsThreadSleep(ahead);
+    }
+    return asynSuccess;
+}
+
+/* Open the capture file for a replay acquisition.
+   NOTE: The caller of this function must have taken the mutex */
+asynStatus dtacq_adc::openReplay()
+{
+    const char *functionName = "openReplay";
+    char fileName[STRINGLEN];
+    getStringParam(DtacqReplayFile, STRINGLEN, fileName);
+    getIntegerParam(DtacqReplayLoop, &this->replayLoop);
+    getDoubleParam(DtacqReplayRate, &this->replayRate);
+    this->replayMutex.lock();
+    if (this->replayFile) fclose(this->replayFile);
+    this->replayFile = fopen(fileName, "rb");
+    this->replayMutex.unlock();
+    this->replayEnded = false;
+    this->replaySamples = 0;
+    epicsTimeGetCurrent(&this->replayStart);
+    if (this->replayFile == NULL) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s unable to open replay file %s: %s\n",
+                  driverName, functionName, fileName, strerror(errno));
+        return asynError;
+    }
+    return asynSuccess;
+}
+
+/* Reads the next frame off the socket into scratch space and throws it away, so that
+   we keep pace with the carrier even when there is nowhere to put the data.
+   NOTE: The caller of this function must have taken the mutex */
+int dtacq_adc::discardFrame(int n_samples, int n_channels, int nBytes)
+{
+    int status;
+    size_t frameBytes = (size_t)n_samples * n_channels * nBytes;
+    if (this->discardBuffer.size() < frameBytes)
+        this->discardBuffer.resize(frameBytes);
+    this->unlock();
+    status = readArray(&this->discardBuffer[0], n_samples, n_channels, nBytes);
+    this->lock();
+    if (status) return status;
+    countDroppedFrame(n_samples, frameBytes);
+    return asynOverflow;
+}
+
+/* Update the overflow accounting for a frame that was read but not published */
+void dtacq_adc::countDroppedFrame(int n_samples, size_t nBytes)
+{
+    int droppedFrames;
+    getIntegerParam(DtacqDroppedFrames, &droppedFrames);
+    setIntegerParam(DtacqDroppedFrames, droppedFrames + 1);
+    this->droppedBytes += nBytes;
+    this->droppedSamples += n_samples;
+    setDoubleParam(DtacqDroppedBytes, (double)this->droppedBytes);
+    setDoubleParam(DtacqDroppedSamples, (double)this->droppedSamples);
+}
+
+/* Reads a frame into pRaw in chunks of chunkSamples, publishing the nOut channels from
+   firstChannel of each chunk on DTACQ_CHUNK_ADDR as soon as it has arrived.
+   NOTE: The caller of this function must NOT hold the mutex */
+int dtacq_adc::readChunked(int n_samples, int n_channels, int nBytes, int chunkSamples, int skipCount,
+                           int firstChannel, int nOut)
+{
+    int status = asynSuccess;
+    int chunkIndex = 0;
+    size_t rowBytes = (size_t)n_channels * nBytes;
+    for (int offset = 0; offset < n_samples; offset += chunkSamples, chunkIndex++) {
+        int rows = (n_samples - offset < chunkSamples) ? n_samples - offset : chunkSamples;
+        char *pChunk = (char *)this->pRaw->pData + offset * rowBytes;
+        status = readArray(pChunk, rows, n_channels, nBytes);
+        if (status) break;
+        publishChunk(pChunk, rows, n_channels, nBytes, skipCount, firstChannel, nOut, offset, chunkIndex);
+    }
+    return status;
+}
+
+/* Mask, scale and publish one chunk of raw samples as an NDFloat64 array. The raw
+   data is left untouched so that the assembled frame can still be processed as normal.
+   NOTE: The caller of this function must NOT hold the mutex */
+void dtacq_adc::publishChunk(const char *pData, int n_samples, int n_channels, int nBytes, int skipCount,
+                             int firstChannel, int nOut, int sampleOffset, int chunkIndex)
+{
+    const char *functionName = "publishChunk";
+    size_t dims[2];
+    dims[0] = nOut;
+    dims[1] = n_samples;
+    NDArray *pChunk = this->pNDArrayPool->alloc(2, dims, NDFloat64, 0, NULL);
+    if (!pChunk) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s: error allocating chunk buffer, chunk %d not published\n",
+                  driverName, functionName, chunkIndex);
+        return;
+    }
+    /* Channels beyond nData are scratchpad words and are passed through unscaled */
+    int nData = dtacqDataColumns(n_channels, skipCount, firstChannel, nOut, (int)this->frameScale.size());
+    const double *scale = &this->frameScale[0] + firstChannel;
+    const double *offset = &this->frameOffset[0] + firstChannel;
+    if (nBytes == 2)
+        dtacqRawToVolts((const epicsInt16 *)pData + firstChannel, (double *)pChunk->pData, n_samples,
+                   n_channels, nOut, nData, (epicsInt16)~0, scale, offset);
+    else
+        dtacqRawToVolts((const epicsInt32 *)pData + firstChannel, (double *)pChunk->pData, n_samples,
+                   n_channels, nOut, nData, (epicsInt32)this->bitMask, scale, offset);
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    pChunk->uniqueId = ++this->chunkCounter;
+    pChunk->timeStamp = now.secPastEpoch + now.nsec / 1.e9;
+    pChunk->pAttributeList->add("ChunkOffset", "Sample offset of this chunk within its frame",
+                                NDAttrInt32, &sampleOffset);
+    pChunk->pAttributeList->add("ChunkIndex", "Index of this chunk within its frame",
+                                NDAttrInt32, &chunkIndex);
+    pChunk->pAttributeList->add("ChunkSamples", "Number of samples in this chunk",
+                                NDAttrInt32, &n_samples);
+    doCallbacksGenericPointer(pChunk, NDArrayData, DTACQ_CHUNK_ADDR);
+    pChunk->release();
+}
+
+/* ID byte of channel c in pRow when the stream has slipped by slip words: word p of the
+   buffer holds the channel that belongs at p + slip */
+static int slippedId(const epicsInt32 *pRow, int rowWidth, int c, int slip)
+{
+    return pRow[(c - slip + rowWidth) % rowWidth] & 0xff;
+}
+
+/* True if, with the stream slipped by slip words, the ID bytes in pRow are numbered as the
+   carrier numbers them: the channels of each site count up in equal steps, and the sites of
+   an aggregate are in the order of their site numbers. Sites of a single channel say nothing
+   about the steps, so a frame made only of those never counts up */
+bool dtacq_adc::idsCountUp(const epicsInt32 *pRow, int rowWidth, int nData, int slip)
+{
+    std::vector<DtacqSite> groups = this->sites;
+    int total = 0;
+    for (size_t s = 0; s < groups.size(); s++) total += groups[s].nChannels;
+    if (groups.empty() || total != nData) {
+        groups.assign(1, DtacqSite());
+        groups[0].firstColumn = 0;
+        groups[0].nChannels = nData;
+    }
+    int step = 0;
+    for (size_t s = 0; s < groups.size(); s++) {
+        int first = groups[s].firstColumn;
+        if (s > 0) {
+            int diff = slippedId(pRow, rowWidth, first, slip) -
+                       slippedId(pRow, rowWidth, groups[s - 1].firstColumn, slip);
+            if (diff == 0 || (diff > 0) != (groups[s].site > groups[s - 1].site)) return false;
+        }
+        for (int c = first + 1; c < first + groups[s].nChannels; c++) {
+            int diff = slippedId(pRow, rowWidth, c, slip) - slippedId(pRow, rowWidth, c - 1, slip);
+            if (step == 0) step = diff;
+            if (diff <= 0 || diff != step) return false;
+        }
+    }
+    return step > 0;
+}
+
+/* Check the site/channel ID byte of every data word in a 32 bit frame against the pattern
+   seen in the first sample of the acquisition. On a mismatch, work out how many words the
+   stream has slipped by, count the frame as misaligned and arrange for the next read to
+   discard enough words to restore the channel phase. Returns asynError for a bad frame.
+
+   The pattern is learnt rather than worked out from the site and channel numbers, as the
+   numbering of the ID byte differs between modules. A stream that is already slipped when
+   the pattern is learnt is caught by the IDs of a site no longer counting up; the check
+   cannot tell if no slip, or more than one, would make them count up.
+   NOTE: The caller of this function must have taken the mutex */
+asynStatus dtacq_adc::checkAlignment(const epicsInt32 *pData, int nRows, int rowWidth, int nData)
+{
+    const char *functionName = "checkAlignment";
+    if (nRows == 0 || nData <= 0) return asynSuccess;
+    int slip = 0, badRow = 0;
+    if ((int)this->idSignature.size() != nData) {
+        if (!idsCountUp(pData, rowWidth, nData, 0)) {
+            for (int k = 1; k < rowWidth; k++) {
+                if (!idsCountUp(pData, rowWidth, nData, k)) continue;
+                if (slip) {
+                    slip = 0;
+                    break;
+                }
+                slip = k;
+            }
+        }
+        if (!slip) {
+            /* Learn the pattern from the first sample; it is only useful if the IDs differ */
+            this->idSignature.resize(nData);
+            this->idCheckUsable = false;
+            for (int c = 0; c < nData; c++) {
+                this->idSignature[c] = pData[c] & 0xff;
+                if (this->idSignature[c] != this->idSignature[0]) this->idCheckUsable = true;
+            }
+        }
+    }
+    if (!slip) {
+        if (!this->idCheckUsable) return asynSuccess;
+
+        const epicsInt32 *pSignature = &this->idSignature[0];
+        badRow = dtacqFindIdMismatch(pData, nRows, rowWidth, nData, pSignature);
+        if (badRow < 0) return asynSuccess;
+        const epicsInt32 *pRow = pData + (size_t)badRow * rowWidth;
+
+        /* Word p of the buffer now holds the channel that belongs at p + slip */
+        for (int k = 1; k < rowWidth && !slip; k++) {
+            bool match = true;
+            for (int c = 0; c < nData && match; c++) {
+                int channel = (c + k) % rowWidth;
+                if (channel < nData && (pRow[c] & 0xff) != pSignature[channel]) match = false;
+            }
+            if (match) slip = k;
+        }
+    }
+    int misaligned;
+    getIntegerParam(DtacqMisaligned, &misaligned);
+    setIntegerParam(DtacqMisaligned, misaligned + 1);
+    setIntegerParam(DtacqAlignSlip, slip);
+    if (slip) {
+        this->realignWords = rowWidth - slip;
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s: channel slip of %d words at sample %d, realigning\n",
+                  driverName, functionName, slip, badRow);
+    } else {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s: channel ID mismatch at sample %d, no consistent slip found\n",
+                  driverName, functionName, badRow);
+    }
+    return asynError;
+}
+
 /* Computes the new image data */
 int dtacq_adc::computeImage()
 {
     int status = asynSuccess;
     NDDataType_t dataType;
     int itemp;
-    int binX, binY, minX, minY, sizeX, sizeY, reverseX, reverseY, invert, nChannels;
+    int binX, binY, minX, minY, sizeX, sizeY, reverseX, reverseY, nChannels;
     int xDim=0, yDim=1;
     int resetImage=1;
     int maxSizeX, maxSizeY;
     const int ndims=2;
-    int spad;
+    int overflowPolicy;
+    int chunkSamples, chunkAssemble;
+    int alignCheck;
     NDDimension_t dimsOut[ndims];
     size_t dims[ndims];
     NDArrayInfo_t arrayInfo;
@@ -253,9 +776,11 @@ int dtacq_adc::computeImage()
     status |= getIntegerParam(ADMaxSizeX,     &maxSizeX);
     status |= getIntegerParam(ADMaxSizeY,     &maxSizeY);
     status |= getIntegerParam(NDDataType,     &itemp);
-    status |= getIntegerParam(DtacqAdcInvert,  &invert);
-    status |= getIntegerParam(DtacqEnableScratchpad, &spad);
     status |= getIntegerParam(DtacqChannels,  &nChannels);
+    status |= getIntegerParam(DtacqOverflowPolicy, &overflowPolicy);
+    status |= getIntegerParam(DtacqChunkSamples, &chunkSamples);
+    status |= getIntegerParam(DtacqChunkAssemble, &chunkAssemble);
+    status |= getIntegerParam(DtacqAlignCheck, &alignCheck);
     dataType = (NDDataType_t)itemp;
     if (status) asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
                           "%s:%s: error getting parameters\n",
@@ -303,67 +828,84 @@ int dtacq_adc::computeImage()
     if (resetImage) {
     /* Free the previous raw buffer */
         if (this->pRaw) this->pRaw->release();
+        this->pRaw = NULL;
         /* Allocate the raw buffer we use to compute images. */
-        dims[xDim] = sizeX;
+        dims[xDim] = maxSizeX;
         dims[yDim] = sizeY;
-        this->pRaw = this->pNDArrayPool->alloc(
-            ndims, dims, dataType, 0, NULL);
+        if (this->pArenaArray && this->pArenaArray->getReferenceCount() == 1 &&
+            (size_t)maxSizeX * sizeY * nBytes <= this->pArenaArray->dataSize) {
+            /* Only we hold the arena frame, so read straight into it again */
+            this->pRaw = this->pArenaArray;
+            this->pRaw->reserve();
+            this->pRaw->ndims = ndims;
+            this->pRaw->initDimension(&this->pRaw->dims[xDim], maxSizeX);
+            this->pRaw->initDimension(&this->pRaw->dims[yDim], sizeY);
+            this->pRaw->dataType = dataType;
+            this->pRaw->pAttributeList->clear();
+        } else {
+            this->pRaw = this->pNDArrayPool->alloc(
+                ndims, dims, dataType, 0, NULL);
+        }
+        if (!this->pRaw && overflowPolicy == DtacqDropOldest && this->pArrays[0]) {
+            /* Plugins hold every other buffer; hand back the frame we kept for read() and retry */
+            this->pArrays[0]->release();
+            this->pArrays[0] = NULL;
+            this->pRaw = this->pNDArrayPool->alloc(
+                ndims, dims, dataType, 0, NULL);
+        }
         if (!this->pRaw) {
             asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                      "%s:%s: error allocating raw buffer\n",
+                      "%s:%s: error allocating raw buffer, dropping frame\n",
                       driverName, functionName);
-            return(status);
+            return discardFrame(sizeY, maxSizeX, nBytes);
         }
     }
+    /* The scratchpad words take two columns each in 16 bit mode */
+    DtacqFrameLayout layout;
+    getFrameLayout(nBytes, &layout);
+    int skipChannels = dtacqSpadColumns(&layout);
+    this->frameLayout = layout;
+    this->frameSkip = skipChannels;
+    /* Take a copy of the scaling tables for this frame so they can be used without the lock */
+    this->frameScale = this->channelScale;
+    this->frameOffset = this->channelOffset;
+    /* Words to throw away to get back into channel phase after a slip was detected */
+    int realignWords = this->realignWords;
+    this->realignWords = 0;
+    if (this->discardBuffer.size() < (size_t)realignWords * nBytes)
+        this->discardBuffer.resize((size_t)realignWords * nBytes);
     this->unlock();
 
-    status = readArray(sizeY, sizeX, dataType);
+    if (realignWords) {
+        status = readArray(&this->discardBuffer[0], 1, realignWords, nBytes);
+        if (status) {
+            this->lock();
+            return(status);
+        }
+    }
+    if (chunkSamples > 0 && chunkSamples < sizeY)
+        status = readChunked(sizeY, maxSizeX, nBytes, chunkSamples, skipChannels, minX, sizeX);
+    else
+        status = readArray((char *)this->pRaw->pData, sizeY, maxSizeX, nBytes);
+    epicsTimeGetCurrent(&this->readDoneTime);
     this->lock();
+    /* In chunk-only mode the chunks have already been published; the assembled frame is
+       kept for the sample count check but not converted or published itself */
+    this->publishFrame = !(chunkSamples > 0 && chunkSamples < sizeY && !chunkAssemble);
 
     if (status) {
         return(status);
     } else {
-	if (spad) {
-	    // Get pointer to sample count
-	    uint32_t *sampleHeader;
-	    // Mark the frame as clean ready to search for inconsistencies.
-	    int dataInconsistent = 0;
-
-	    for (int i = 0; i < sizeY; i++) {
-		// Sample count is always stored in the last 32 bits of each sample
-		// Yucky pointer arithmetic ahead.
-		// We want the sample count which is always a 32 bit integer.
-		// But this is embedded in a stream of data which may consist of either 32 bit or 16 bit integers.
-		// So we need to first work with 8 bit pointer arithmetic to find the correct offset (with a scaling factor depending
-		// on the stored data type), then convert to a 32 bit integer pointer to retrieve the actual data.
-	      uint8_t *intermediate = ((uint8_t *)this->pRaw->pData) + i*sizeX*nBytes + (sizeX*nBytes - 4);
-	      sampleHeader = (uint32_t *)intermediate;
-	      // If we have a sample count stored from the last sample, check this sample is the one we expect.
-	      if (cleanSampleSeen) {
-		  if (*sampleHeader == sampleCount) {
-		      // Handle integer overflow on the dtacq side (our sample count var needs to be > 32 bits for this reason)
-		      if (sampleCount == 4294967295)
-			sampleCount = 0;
-		      else
-			sampleCount++;
-		  } else {
-		      cleanSampleSeen = false;
-		      dataInconsistent = 1;
-		      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
-                      "%s:%s: Sample count mismatch - bad or out of order data (expected %ld, got %d)\n",
-                      driverName, functionName, sampleCount, *sampleHeader);
-		  }
-	      } else {
-		  // If we haven't stored a sample count yet, store this one.
-		  cleanSampleSeen = true;
-		  if ((*sampleHeader) == 4294967295)
-		    sampleCount = 0;
-		  else
-		    sampleCount = *sampleHeader + 1;
-	      }
-	    }
-
-	    if (dataInconsistent) {
+	if (dtacqHasSampleCounter(&layout)) {
+	    uint64_t badExpected;
+	    uint32_t badValue;
+	    int nBad = dtacqCheckSampleCounts(this->pRaw->pData, sizeY, (size_t)maxSizeX * nBytes,
+	                                      dtacqSpadOffset(&layout, 0),
+	                                      &sampleCount, &cleanSampleSeen, &badExpected, &badValue);
+	    if (nBad) {
+		asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                      "%s:%s: Sample count mismatch - bad or out of order data (expected %llu, got %u, %d bad samples)\n",
+                      driverName, functionName, (unsigned long long)badExpected, badValue, nBad);
 		int badFrameCount;
 		getIntegerParam(DtacqBadFrames, &badFrameCount);
 		badFrameCount++;
@@ -371,47 +913,81 @@ int dtacq_adc::computeImage()
 		return(asynError);
 	    }
 	}
+	if (alignCheck && nBytes == 4) {
+	    status = checkAlignment((const epicsInt32 *)this->pRaw->pData, sizeY, maxSizeX,
+	                            maxSizeX - skipChannels);
+	    if (status) return(status);
+	}
+	if (!this->publishFrame) return(asynSuccess);
 
-	/* Mask out the last 8 bits if we have 24bit data in a 32bit word */
-	// ###TODO: Conceivably we could have a 32 bit data stream coming from ACQ420. Really should switch on module type, not bytes. But not really a problem since low bits of
-	// ACQ420 will be unused anyway.
-	if (nBytes == 4) status = applyBitMask(this->pRaw, nChannels, spad);
-
-        /* Extract the region of interest with binning.
-           If the entire image is being used (no ROI or binning) that's OK because
-           convertImage detects that case and is very efficient */
+        /* The channel subset (MinX, SizeX) is gathered straight out of the raw frame by the
+           conversion kernel, so only the channels being published are masked and scaled.
+           Binning, reversal and the Y region of interest are then applied by convert(),
+           which is skipped entirely in the usual case where none of them are in use */
         this->pRaw->initDimension(&dimsOut[xDim], sizeX);
         this->pRaw->initDimension(&dimsOut[yDim], sizeY);
         dimsOut[xDim].binning = binX;
-        dimsOut[xDim].offset  = minX;
+        dimsOut[xDim].offset  = 0;
         dimsOut[xDim].reverse = reverseX;
         dimsOut[yDim].binning = binY;
         dimsOut[yDim].offset  = minY;
         dimsOut[yDim].reverse = reverseY;
+        bool fullFrame = (binX == 1 && binY == 1 && minY == 0 && !reverseX && !reverseY);
         /* We save the most recent image buffer so it can be used in the
            read() function. Now release it before getting a new version. */
         if (this->pArrays[0]) this->pArrays[0]->release();
-        /* Convert the raw frame to NDFloat64 and apply driver ROI */
-        status = this->pNDArrayPool->convert(this->pRaw, &this->pArrays[0],
-                                             NDFloat64, dimsOut);
-        /* If we are running in 16 bit mode we will have 2 channels taken up by the sample count if it's enable, otherwise only 1 channel in 32 bit mode */
-        int skipChannels = 0;
-        if (spad) {
-          if (nBytes == 2)
-            skipChannels = 2;
-          else
-            skipChannels = 1;
+        this->pArrays[0] = NULL;
+        /* Mask, convert to NDFloat64 and apply the per-channel calibration in one pass */
+        dims[xDim] = sizeX;
+        dims[yDim] = sizeY;
+        NDArray *pVolts = this->pNDArrayPool->alloc(ndims, dims, NDFloat64, 0, NULL);
+        if (!pVolts) {
+            this->pRaw->getInfo(&arrayInfo);
+            if (overflowPolicy != DtacqRawOnly) {
+                asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                          "%s:%s: error allocating Float64 buffer, dropping frame\n",
+                          driverName, functionName);
+                countDroppedFrame(sizeY, arrayInfo.totalBytes);
+                return(asynOverflow);
+            }
+            /* Record the raw counts rather than lose the frame */
+            int rawFrames;
+            getIntegerParam(DtacqRawFrames, &rawFrames);
+            setIntegerParam(DtacqRawFrames, rawFrames + 1);
+            /* Mask out the last 8 bits if we have 24bit data in a 32bit word */
+            if (nBytes == 4) applyBitMask(this->pRaw, nChannels, skipChannels);
+            this->pRaw->reserve();
+            this->pArrays[0] = this->pRaw;
+            addSpadAttributes(this->pRaw);
+            status |= setIntegerParam(NDArraySize,  (int)arrayInfo.totalBytes);
+            status |= setIntegerParam(NDArraySizeX, (int)this->pRaw->dims[xDim].size);
+            status |= setIntegerParam(NDArraySizeY, (int)this->pRaw->dims[yDim].size);
+            return(asynSuccess);
         }
         /* Scale the raw values down to voltages */
-        status = applyScaling(this->pArrays[0], nChannels, skipChannels);
+        status = applyScaling(this->pRaw, pVolts, minX, skipChannels);
         if (status) {
-            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                      "%s:%s: error allocating buffer in convert()\n",
-                      driverName, functionName);
+            pVolts->release();
             return(status);
         }
+        if (fullFrame) {
+            this->pArrays[0] = pVolts;
+        } else {
+            status = this->pNDArrayPool->convert(pVolts, &this->pArrays[0],
+                                                 NDFloat64, dimsOut);
+            pVolts->release();
+            if (status || !this->pArrays[0]) {
+                this->pArrays[0] = NULL;
+                asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                          "%s:%s: error allocating buffer in convert(), dropping frame\n",
+                          driverName, functionName);
+                countDroppedFrame(sizeY, (size_t)maxSizeX * sizeY * nBytes);
+                return(asynOverflow);
+            }
+        }
         pImage = this->pArrays[0];
         pImage->getInfo(&arrayInfo);
+        addSpadAttributes(pImage);
 
         status = asynSuccess;
         status |= setIntegerParam(NDArraySize,  (int)arrayInfo.totalBytes);
@@ -426,11 +1002,599 @@ int dtacq_adc::computeImage()
 
 
 
+/* Compress one block of the current raw frame; called from the worker pool */
+void dtacq_adc::compressBlock(int block, int worker)
+{
+    this->compressSizes[block] = dtacqCompressBlock(&this->compressFrame, block,
+                                                    &this->compressSlots[block * this->compressBound],
+                                                    &this->workerScratch[worker]);
+}
+
+/* Losslessly compress the raw frame (with the site/channel byte masked off) on the worker
+   pool and publish it as an NDUInt8 array on DTACQ_COMPRESSED_ADDR. The codec is described
+   by the array's attributes; see dtacqCompress.h.
+   NOTE: The caller of this function must have taken the mutex; it is released while compressing */
+void dtacq_adc::publishCompressed(int uniqueId, epicsTimeStamp timeStamp, int arrayCallbacks)
+{
+    const char *functionName = "publishCompressed";
+    NDArrayInfo_t rawInfo;
+    int verify;
+    getIntegerParam(DtacqCompressVerify, &verify);
+    this->pRaw->getInfo(&rawInfo);
+    this->compressFrame.pData = this->pRaw->pData;
+    this->compressFrame.elemSize = rawInfo.bytesPerElement;
+    this->compressFrame.rowWidth = (int)this->pRaw->dims[0].size;
+    this->compressFrame.nRows = (int)this->pRaw->dims[1].size;
+    this->compressFrame.nData = this->compressFrame.rowWidth - this->frameSkip;
+    this->compressFrame.dataShift = (rawInfo.bytesPerElement == 4) ? 8 : 0;
+    int nBlocks = dtacqCodecBlockCount(&this->compressFrame);
+    this->compressBound = dtacqCodecBlockBound(&this->compressFrame);
+    this->compressSlots.resize(nBlocks * this->compressBound);
+    this->compressSizes.resize(nBlocks);
+
+    this->unlock();
+    this->workerPool->run(compressBlockC, this, nBlocks);
+
+    size_t headerSize = dtacqCodecHeaderSize(nBlocks);
+    size_t totalSize = headerSize;
+    for (int b = 0; b < nBlocks; b++) totalSize += this->compressSizes[b] & ~DTACQ_CODEC_STORED;
+    size_t dims[1];
+    dims[0] = totalSize;
+    NDArray *pCompressed = this->pNDArrayPool->alloc(1, dims, NDUInt8, 0, NULL);
+    if (pCompressed) {
+        uint8_t *pOut = (uint8_t *)pCompressed->pData;
+        dtacqCodecWriteHeader(&this->compressFrame, &this->compressSizes[0], pOut);
+        pOut += headerSize;
+        for (int b = 0; b < nBlocks; b++) {
+            size_t size = this->compressSizes[b] & ~DTACQ_CODEC_STORED;
+            memcpy(pOut, &this->compressSlots[b * this->compressBound], size);
+            pOut += size;
+        }
+    }
+    int mismatches = 0;
+    if (pCompressed && verify) {
+        /* Check the round trip against the masked raw frame */
+        if (this->verifyBuffer.size() < rawInfo.totalBytes) this->verifyBuffer.resize(rawInfo.totalBytes);
+        long nDecoded = dtacqDecompress((const uint8_t *)pCompressed->pData, totalSize,
+                                        &this->verifyBuffer[0], this->verifyBuffer.size());
+        if (nDecoded != (long)rawInfo.totalBytes) {
+            mismatches = 1;
+        } else if (rawInfo.bytesPerElement == 4) {
+            const epicsInt32 *pRawData = (const epicsInt32 *)this->pRaw->pData;
+            const epicsInt32 *pDecoded = (const epicsInt32 *)&this->verifyBuffer[0];
+            int rowWidth = this->compressFrame.rowWidth;
+            for (size_t i = 0; i < rawInfo.nElements && !mismatches; i++) {
+                epicsInt32 expected = ((int)(i % rowWidth) < this->compressFrame.nData) ?
+                                      (pRawData[i] & this->bitMask) : pRawData[i];
+                if (pDecoded[i] != expected) mismatches = 1;
+            }
+        } else {
+            mismatches = memcmp(this->pRaw->pData, &this->verifyBuffer[0], rawInfo.totalBytes) != 0;
+        }
+    }
+    if (pCompressed && arrayCallbacks) {
+        int dataType = this->pRaw->dataType;
+        int uncompressedSize = (int)rawInfo.totalBytes;
+        int sizeX = this->compressFrame.rowWidth, sizeY = this->compressFrame.nRows;
+        pCompressed->uniqueId = uniqueId;
+        pCompressed->timeStamp = timeStamp.secPastEpoch + timeStamp.nsec / 1.e9;
+        pCompressed->pAttributeList->add("Codec", "Compression applied to this array",
+                                         NDAttrString, (void *)DTACQ_CODEC_NAME);
+        pCompressed->pAttributeList->add("CodecDataType", "NDDataType of the decompressed frame",
+                                         NDAttrInt32, &dataType);
+        pCompressed->pAttributeList->add("CodecSizeX", "Decompressed frame width",
+                                         NDAttrInt32, &sizeX);
+        pCompressed->pAttributeList->add("CodecSizeY", "Decompressed frame height",
+                                         NDAttrInt32, &sizeY);
+        pCompressed->pAttributeList->add("CodecUncompressedSize", "Decompressed size in bytes",
+                                         NDAttrInt32, &uncompressedSize);
+        doCallbacksGenericPointer(pCompressed, NDArrayData, DTACQ_COMPRESSED_ADDR);
+    }
+    if (pCompressed) pCompressed->release();
+    this->lock();
+
+    if (!pCompressed) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s: error allocating compressed buffer\n", driverName, functionName);
+        return;
+    }
+    setDoubleParam(DtacqCompressRatio, (double)rawInfo.totalBytes / totalSize);
+    if (mismatches) {
+        int errors;
+        getIntegerParam(DtacqCompressErrors, &errors);
+        setIntegerParam(DtacqCompressErrors, errors + 1);
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s: compressed frame %d does not decompress to the raw frame\n",
+                  driverName, functionName, uniqueId);
+    }
+}
+
+/* Split the aggregated raw frame into one NDFloat64 frame per site, published on
+   DTACQ_SITE_ADDR + n in AGGR_SITES order. Each site is scaled with its own module's
+   range table (see updateCalibration). The raw frame is walked once, converting
+   DTACQ_DEMUX_ROWS rows of every site before moving on, so it stays in cache.
+   NOTE: The caller of this function must have taken the mutex; it is released while converting */
+void dtacq_adc::publishSites(int uniqueId, epicsTimeStamp timeStamp, int arrayCallbacks)
+{
+    const char *functionName = "publishSites";
+    int demux;
+    getIntegerParam(DtacqDemuxSites, &demux);
+    if (!demux || this->sites.empty()) return;
+    /* Work on a copy of the site table, since the mutex is released while converting */
+    std::vector<DtacqSite> frameSites = this->sites;
+    int inWidth = (int)this->pRaw->dims[0].size;
+    int nRows = (int)this->pRaw->dims[1].size;
+    const DtacqSite &last = frameSites.back();
+    if (last.firstColumn + last.nChannels > inWidth - this->frameSkip ||
+        last.firstColumn + last.nChannels > (int)this->frameScale.size()) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s: sites hold more channels than the frame, not demultiplexing\n",
+                  driverName, functionName);
+        return;
+    }
+    size_t nSites = frameSites.size();
+    std::vector<NDArray *> siteArrays(nSites, (NDArray *)NULL);
+    for (size_t s = 0; s < nSites; s++) {
+        size_t dims[2];
+        dims[0] = frameSites[s].nChannels;
+        dims[1] = nRows;
+        siteArrays[s] = this->pNDArrayPool->alloc(2, dims, NDFloat64, 0, NULL);
+        if (!siteArrays[s])
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                      "%s:%s: error allocating buffer for site %d\n",
+                      driverName, functionName, frameSites[s].site);
+    }
+    bool raw16 = (this->pRaw->dataType == NDInt16);
+    this->unlock();
+
+    for (int row = 0; row < nRows; row += DTACQ_DEMUX_ROWS) {
+        int rows = (nRows - row < DTACQ_DEMUX_ROWS) ? nRows - row : DTACQ_DEMUX_ROWS;
+        for (size_t s = 0; s < nSites; s++) {
+            if (!siteArrays[s]) continue;
+            int first = frameSites[s].firstColumn;
+            int width = frameSites[s].nChannels;
+            double *pOut = (double *)siteArrays[s]->pData + (size_t)row * width;
+            if (raw16)
+                dtacqRawToVolts((const epicsInt16 *)this->pRaw->pData + (size_t)row * inWidth + first, pOut,
+                           rows, inWidth, width, width, (epicsInt16)~0,
+                           &this->frameScale[first], &this->frameOffset[first]);
+            else
+                dtacqRawToVolts((const epicsInt32 *)this->pRaw->pData + (size_t)row * inWidth + first, pOut,
+                           rows, inWidth, width, width, (epicsInt32)this->bitMask,
+                           &this->frameScale[first], &this->frameOffset[first]);
+        }
+    }
+    for (size_t s = 0; s < nSites; s++) {
+        NDArray *pSite = siteArrays[s];
+        if (!pSite) continue;
+        if (arrayCallbacks) {
+            pSite->uniqueId = uniqueId;
+            pSite->timeStamp = timeStamp.secPastEpoch + timeStamp.nsec / 1.e9;
+            pSite->pAttributeList->add("Site", "Carrier site of this module",
+                                       NDAttrInt32, &frameSites[s].site);
+            pSite->pAttributeList->add("ModuleType", "Module type reported by the site",
+                                       NDAttrInt32, &frameSites[s].moduleType);
+            pSite->pAttributeList->add("FirstChannel", "Channel of the aggregated frame the site starts at",
+                                       NDAttrInt32, &frameSites[s].firstColumn);
+            doCallbacksGenericPointer(pSite, NDArrayData, DTACQ_SITE_ADDR + (int)s);
+        }
+        pSite->release();
+    }
+    this->lock();
+}
+
+/* Feed a published frame into the sample ring and publish every complete window of
+   WINDOW_LENGTH samples, one every WINDOW_HOP samples, on DTACQ_WINDOW_ADDR. Windows
+   point into the ring, so overlapping windows share their samples (see dtacqSampleRing.h).
+   Only NDFloat64 frames are windowed; raw-only frames restart the ring.
+   NOTE: The caller of this function must have taken the mutex; it is released for callbacks */
+void dtacq_adc::publishWindows(NDArray *pFrame, epicsTimeStamp timeStamp, int arrayCallbacks)
+{
+    const char *functionName = "publishWindows";
+    int length, hop, windowCount, windowDropped;
+    getIntegerParam(DtacqWindowLength, &length);
+    getIntegerParam(DtacqWindowHop, &hop);
+    if (length <= 0) return;
+    if (pFrame->dataType != NDFloat64 || pFrame->ndims != 2) {
+        this->windowRing->restart();
+        return;
+    }
+    int width = (int)pFrame->dims[0].size;
+    int nRows = (int)pFrame->dims[1].size;
+    if (hop <= 0) hop = length;
+    if (!this->windowRing->matches(width, length, hop) &&
+        !this->windowRing->configure(width, length, hop)) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                  "%s:%s: windows still held by plugins, waiting to resize the ring\n",
+                  driverName, functionName);
+        return;
+    }
+    getIntegerParam(DtacqWindowCount, &windowCount);
+    getIntegerParam(DtacqWindowDropped, &windowDropped);
+    const double *pData = (const double *)pFrame->pData;
+    int row = 0;
+    while (1) {
+        double firstSample;
+        bool dropped;
+        NDArray *pWindow = this->windowRing->nextWindow(&firstSample, &dropped);
+        if (dropped) windowDropped++;
+        if (pWindow) {
+            windowCount++;
+            if (arrayCallbacks) {
+                pWindow->uniqueId = ++this->windowCounter;
+                pWindow->timeStamp = timeStamp.secPastEpoch + timeStamp.nsec / 1.e9;
+                pWindow->pAttributeList->add("WindowStart", "Index of the first sample since the ring was configured, "
+                                             "counting samples lost from dropped frames",
+                                             NDAttrFloat64, &firstSample);
+                pWindow->pAttributeList->add("WindowHop", "Samples between the starts of consecutive windows",
+                                             NDAttrInt32, &hop);
+                this->unlock();
+                doCallbacksGenericPointer(pWindow, NDArrayData, DTACQ_WINDOW_ADDR);
+                this->lock();
+            }
+            continue;
+        }
+        if (dropped) continue;
+        if (row >= nRows) break;
+        int taken = this->windowRing->append(pData + (size_t)row * width, nRows - row);
+        if (taken == 0) {
+            /* Every row the ring could use is pinned by a window a plugin still holds */
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                      "%s:%s: sample ring full, dropping %d samples\n",
+                      driverName, functionName, nRows - row);
+            windowDropped++;
+            this->windowRing->restart();
+            this->windowRing->skipSamples(nRows - row);
+            break;
+        }
+        row += taken;
+    }
+    setIntegerParam(DtacqWindowCount, windowCount);
+    setIntegerParam(DtacqWindowDropped, windowDropped);
+}
+
+/* Accumulate the periodograms of one pair of channels of the current frame; called from the worker pool */
+void dtacq_adc::spectrumPair(int pair, int worker)
+{
+    this->spectrum->accumulatePair(this->spectrumFrame, this->spectrumRows, this->spectrumWidth,
+                                   pair, &this->spectrumScratch[worker]);
+}
+
+/* Add a published frame to the Welch average of every channel's power spectrum, with the
+   channel pairs spread over the worker pool. Every FFT_AVERAGES frames the averaged PSD
+   (V^2/Hz, using ACTUAL_SAMPLE_RATE) is published as an NDFloat64 array of
+   [FFT_SIZE/2+1, channels] on DTACQ_FFT_ADDR, and the spectrum of FFT_CHANNEL is also
+   published with its frequency axis as the FFT_PSD and FFT_FREQ waveforms.
+   NOTE: The caller of this function must have taken the mutex; it is released while computing */
+void dtacq_adc::publishSpectrum(NDArray *pFrame, epicsTimeStamp timeStamp, int arrayCallbacks)
+{
+    const char *functionName = "publishSpectrum";
+    int fftSize, averages, channel;
+    double sampleRate;
+    /* Only this thread runs the workers on the sums, so it is safe to clear them here */
+    if (this->spectrumReset) {
+        this->spectrum->reset();
+        this->spectrumFrames = 0;
+        this->spectrumReset = false;
+    }
+    getIntegerParam(DtacqFftSize, &fftSize);
+    if (fftSize <= 0 || pFrame->dataType != NDFloat64 || pFrame->ndims != 2) return;
+    getIntegerParam(DtacqFftAverages, &averages);
+    getIntegerParam(DtacqFftChannel, &channel);
+    getDoubleParam(DtacqActualSampleRate, &sampleRate);
+    int width = (int)pFrame->dims[0].size;
+    int nRows = (int)pFrame->dims[1].size;
+    /* Round down to a power of two; writeInt32() refuses sizes below 4 */
+    int size = 4;
+    while (size * 2 <= fftSize) size *= 2;
+    if (!this->spectrum->matches(size, width)) {
+        this->spectrum->configure(size, width);
+        this->spectrumFrames = 0;
+        setIntegerParam(DtacqFftSize, size);
+    }
+    if (this->spectrum->segmentsIn(nRows) == 0) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                  "%s:%s: frame of %d samples is shorter than FFT_SIZE %d\n",
+                  driverName, functionName, nRows, size);
+        return;
+    }
+    this->spectrumFrame = (const double *)pFrame->pData;
+    this->spectrumRows = nRows;
+    this->spectrumWidth = width;
+    this->unlock();
+    this->workerPool->run(spectrumPairC, this, this->spectrum->pairs());
+    this->lock();
+    this->spectrum->addFrame(nRows);
+    if (++this->spectrumFrames < averages) return;
+    this->spectrumFrames = 0;
+
+    int nBins = this->spectrum->bins();
+    int segments = this->spectrum->segments();
+    double freqStep = ((sampleRate > 0) ? sampleRate : 1.0) / size;
+    size_t dims[2];
+    dims[0] = nBins;
+    dims[1] = width;
+    NDArray *pSpectrum = this->pNDArrayPool->alloc(2, dims, NDFloat64, 0, NULL);
+    this->spectrumOut.resize((size_t)nBins * width);
+    this->spectrum->average(sampleRate, pSpectrum ? (double *)pSpectrum->pData : &this->spectrumOut[0]);
+    if (!pSpectrum)
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s: error allocating spectrum buffer\n", driverName, functionName);
+    else
+        memcpy(&this->spectrumOut[0], pSpectrum->pData, (size_t)nBins * width * sizeof(double));
+    int count;
+    getIntegerParam(DtacqFftCount, &count);
+    setIntegerParam(DtacqFftCount, count + 1);
+    setDoubleParam(DtacqFftFreqStep, freqStep);
+    this->spectrumFreq.resize(nBins);
+    for (int k = 0; k < nBins; k++) this->spectrumFreq[k] = k * freqStep;
+    if (channel < 1) channel = 1;
+    if (channel > width) channel = width;
+    this->unlock();
+    doCallbacksFloat64Array(&this->spectrumFreq[0], nBins, DtacqFftFreq, 0);
+    doCallbacksFloat64Array(&this->spectrumOut[(size_t)(channel - 1) * nBins], nBins, DtacqFftPsd, 0);
+    if (pSpectrum) {
+        if (arrayCallbacks) {
+            pSpectrum->uniqueId = ++this->spectrumCounter;
+            pSpectrum->timeStamp = timeStamp.secPastEpoch + timeStamp.nsec / 1.e9;
+            pSpectrum->pAttributeList->add("FrequencyStep", "Hz between spectral bins (1/sample if the rate is unknown)",
+                                           NDAttrFloat64, &freqStep);
+            pSpectrum->pAttributeList->add("Segments", "Windowed segments averaged into this spectrum",
+                                           NDAttrInt32, &segments);
+            doCallbacksGenericPointer(pSpectrum, NDArrayData, DTACQ_FFT_ADDR);
+        }
+        pSpectrum->release();
+    }
+    this->lock();
+}
+
+/* Choose the length of the next frame when ADAPT_MODE is on. The cost of the frame just
+   published (end of its read to now) feeds the model in dtacqFrameSizer; the sample rate is
+   ACTUAL_SAMPLE_RATE, or the rate measured from the frame intervals if that is 0. The new
+   length is written to ADSizeY here, between frames, so it takes effect when computeImage()
+   allocates the next raw buffer and a frame is never resized while it is being read.
+   NOTE: The caller of this function must have taken the mutex */
+void dtacq_adc::adaptFrameLength()
+{
+    const char *functionName = "adaptFrameLength";
+    if (!this->pRaw) return;
+    int nSamples = (int)this->pRaw->dims[1].size;
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    double cost = epicsTimeDiffInSeconds(&now, &this->readDoneTime);
+    double interval = this->lastReadValid ? epicsTimeDiffInSeconds(&this->readDoneTime, &this->lastReadDone) : 0;
+    this->lastReadDone = this->readDoneTime;
+    this->lastReadValid = true;
+    this->frameSizer->addFrame(nSamples, cost, interval);
+    setDoubleParam(DtacqPipelineTime, cost);
+
+    int mode, minSamples, maxSamples, sizeY, minY, maxSizeY;
+    double target, sampleRate;
+    getIntegerParam(DtacqAdaptMode, &mode);
+    getDoubleParam(DtacqAdaptTarget, &target);
+    getIntegerParam(DtacqAdaptMin, &minSamples);
+    getIntegerParam(DtacqAdaptMax, &maxSamples);
+    getIntegerParam(ADSizeY, &sizeY);
+    getIntegerParam(ADMinY, &minY);
+    getIntegerParam(ADMaxSizeY, &maxSizeY);
+    getDoubleParam(DtacqActualSampleRate, &sampleRate);
+    if (sampleRate <= 0 || this->replayMode == DtacqReplayFast) sampleRate = this->frameSizer->measuredRate();
+    setDoubleParam(DtacqAdaptRate, sampleRate);
+    if (mode == DtacqAdaptOff) {
+        setIntegerParam(DtacqAdaptSamples, sizeY);
+        return;
+    }
+    /* No longer than the raw buffers were sized for */
+    if (maxSamples <= 0 || maxSamples > maxSizeY - minY) maxSamples = maxSizeY - minY;
+    int chosen = this->frameSizer->choose(mode, target, sampleRate, sizeY, minSamples, maxSamples);
+    if (chosen != sizeY) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                  "%s:%s: frame length %d -> %d samples (%.0f Hz, %.3f ms per frame)\n",
+                  driverName, functionName, sizeY, chosen, sampleRate, cost * 1e3);
+        setIntegerParam(ADSizeY, chosen);
+    }
+    setIntegerParam(DtacqAdaptSamples, chosen);
+}
+
+/* Copy the frame, or with SHM_SOURCE the raw frame it came from, into the shared memory
+   ring read by local processes (see dtacqShm.h). The ring is created, or replaced, here
+   between frames whenever SHM_NAME, SHM_SLOTS or SHM_SLOT_MB change; with SHM_SLOT_MB 0
+   the slots are sized to the frame and grow with it. An empty SHM_NAME turns it off.
+   NOTE: The caller of this function must have taken the mutex; it is released while copying */
+void dtacq_adc::publishShm(NDArray *pFrame, epicsTimeStamp timeStamp)
+{
+    const char *functionName = "publishShm";
+    char name[STRINGLEN], config[STRINGLEN + 64], message[STRINGLEN + 64];
+    int nSlots, slotMB, source, dropped;
+    getStringParam(DtacqShmName, STRINGLEN, name);
+    if (name[0] == '\0') {
+        if (this->shmWriter->isOpen()) {
+            this->shmWriter->close();
+            setStringParam(DtacqShmStatus, "Off");
+        }
+        return;
+    }
+    getIntegerParam(DtacqShmSlots, &nSlots);
+    getIntegerParam(DtacqShmSlotMB, &slotMB);
+    getIntegerParam(DtacqShmSource, &source);
+    getIntegerParam(DtacqShmDropped, &dropped);
+    if (nSlots < 1) nSlots = 1;
+    NDArray *pSource = (source == DtacqShmRaw && this->pRaw) ? this->pRaw : pFrame;
+    NDArrayInfo_t arrayInfo;
+    pSource->getInfo(&arrayInfo);
+    size_t capacity = (slotMB > 0) ? (size_t)slotMB << 20 : arrayInfo.totalBytes;
+    bool resize = (slotMB > 0) ? capacity != this->shmWriter->capacity()
+                               : capacity > this->shmWriter->capacity();
+    if (!this->shmWriter->isOpen() || strcmp(name, this->shmWriter->name()) ||
+        nSlots != this->shmWriter->slots() || resize) {
+        epicsSnprintf(config, sizeof(config), "%s %d %lu", name, nSlots, (unsigned long)capacity);
+        /* Don't try again on every frame with a configuration that has already failed */
+        if (this->shmFailed == config) {
+            setIntegerParam(DtacqShmDropped, dropped + 1);
+            return;
+        }
+        int err = this->shmWriter->open(name, nSlots, capacity);
+        if (err) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s unable to create shared memory %s: %s\n",
+                      driverName, functionName, name, strerror(err));
+            epicsSnprintf(message, sizeof(message), "Error: %s", strerror(err));
+            setStringParam(DtacqShmStatus, message);
+            setIntegerParam(DtacqShmDropped, dropped + 1);
+            this->shmFailed = config;
+            return;
+        }
+        this->shmFailed.clear();
+        epicsSnprintf(message, sizeof(message), "%d slots of %lu bytes", nSlots, (unsigned long)capacity);
+        setStringParam(DtacqShmStatus, message);
+    }
+    DtacqShmFrameInfo info;
+    memset(&info, 0, sizeof(info));
+    info.uniqueId = pFrame->uniqueId;
+    info.dataType = pSource->dataType;
+    info.ndims = (pSource->ndims < DTACQ_SHM_MAX_DIMS) ? pSource->ndims : DTACQ_SHM_MAX_DIMS;
+    for (int d = 0; d < info.ndims; d++) info.dims[d] = pSource->dims[d].size;
+    info.dataBytes = arrayInfo.totalBytes;
+    info.timeStamp = pFrame->timeStamp;
+    info.secPastEpoch = timeStamp.secPastEpoch;
+    info.nsec = timeStamp.nsec;
+    if (this->pRaw && this->frameLayout.spadWords > 0) {
+        info.spadWords = this->frameLayout.spadWords;
+        dtacqReadSpad(this->pRaw->pData, &this->frameLayout, info.spad);
+    }
+    /* Only this thread replaces pRaw and the published frame, so both stay put while unlocked */
+    this->unlock();
+    bool written = this->shmWriter->publish(&info, pSource->pData);
+    this->lock();
+    if (!written)
+        setIntegerParam(DtacqShmDropped, dropped + 1);
+    setIntegerParam(DtacqShmFrames, (int)this->shmWriter->frames());
+}
+
 /* Disconnect from the data stream. Called at the end of each acquisition */
 void dtacq_adc::closeSocket()
 {
+    if (this->replayMode != DtacqReplayOff) {
+        /* Waits for any read in progress to finish before closing the capture file */
+        this->replayMutex.lock();
+        if (this->replayFile) fclose(this->replayFile);
+        this->replayFile = NULL;
+        this->replayMutex.unlock();
+        this->dataSocket = -1;
+        return;
+    }
+    if (this->commonDataIPPort == NULL) return;
     pasynManager->autoConnect(this->commonDataIPPort, 0);
     pasynCommonSyncIO->disconnectDevice(this->commonDataIPPort);
+    this->dataSocket = -1;
+}
+
+/* Start a fresh set of receive queue measurements.
+   NOTE: The caller of this function must have taken the mutex */
+void dtacq_adc::resetBacklog()
+{
+    this->bytesConsumed = 0;
+    this->backlogBytes = 0;
+    this->lastQueued = 0;
+    epicsTimeGetCurrent(&this->backlogTime);
+    this->readSampleTime = this->backlogTime;
+    setDoubleParam(DtacqSocketBacklog, 0.0);
+    setDoubleParam(DtacqBacklogFill, 0.0);
+    setDoubleParam(DtacqConsumedRate, 0.0);
+    setDoubleParam(DtacqExpectedRate, 0.0);
+    setDoubleParam(DtacqHeadroom, 0.0);
+    setDoubleParam(DtacqOverrunTime, -1.0);
+    setIntegerParam(DtacqOverrunPredicted, 0);
+}
+
+/* Every DTACQ_BACKLOG_INTERVAL, sample the kernel receive queue of the data connection and
+   compare the rate the reader consumes data at with the rate the carrier produces it
+   (ACTUAL_SAMPLE_RATE x row width x word size). HEADROOM is the difference as a percentage
+   of the production rate; it sits near 0 while keeping up and goes negative when falling
+   behind. OVERRUN_PREDICTED is raised when the receive buffer is nearly full, or when the
+   backlog is growing fast enough to fill it within OVERRUN_WARN_TIME. It is called from
+   readArray() between reads, so long frames are sampled while they are being read.
+   NOTE: The caller of this function must have taken the mutex */
+void dtacq_adc::updateBacklog()
+{
+    if (this->replayMode != DtacqReplayOff) return;
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    double elapsed = epicsTimeDiffInSeconds(&now, &this->backlogTime);
+    if (elapsed < DTACQ_BACKLOG_INTERVAL) return;
+
+    double sampleRate, warnTime;
+    int maxSizeX, dataType;
+    getDoubleParam(DtacqActualSampleRate, &sampleRate);
+    getDoubleParam(DtacqOverrunWarnTime, &warnTime);
+    getIntegerParam(ADMaxSizeX, &maxSizeX);
+    getIntegerParam(NDDataType, &dataType);
+    double consumed = (double)(this->bytesConsumed - this->backlogBytes) / elapsed;
+    double expected = sampleRate * maxSizeX * ((dataType == NDInt16) ? 2 : 4);
+    setDoubleParam(DtacqConsumedRate, consumed);
+    setDoubleParam(DtacqExpectedRate, expected);
+    setDoubleParam(DtacqHeadroom, (expected > 0) ? 100.0 * (consumed - expected) / expected : 0.0);
+
+    long queued = 0, bufferSize = 0;
+    /* The socket is found once when the data port is connected; if it has gone, stop sampling
+       rather than search for it again */
+    if (this->dataSocket >= 0 && dtacqSocketQueue(this->dataSocket, &queued, &bufferSize) != 0) {
+        this->dataSocket = -1;
+        queued = bufferSize = 0;
+    }
+    int predicted = 0;
+    double timeToFull = -1.0;
+    if (bufferSize > 0) {
+        /* Prefer the measured growth of the queue; the rate deficit covers the case where
+           the queue has not been sampled before */
+        double growth = (queued - this->lastQueued) / elapsed;
+        if (growth <= 0 && expected > consumed && queued > 0) growth = expected - consumed;
+        if (growth > 0) timeToFull = (bufferSize - queued) / growth;
+        predicted = (queued > DTACQ_BACKLOG_FULL * bufferSize) ||
+                    (timeToFull >= 0 && timeToFull < warnTime);
+        setDoubleParam(DtacqBacklogFill, 100.0 * queued / bufferSize);
+    }
+    setDoubleParam(DtacqSocketBacklog, (double)queued);
+    setDoubleParam(DtacqOverrunTime, timeToFull);
+    setIntegerParam(DtacqOverrunPredicted, predicted);
+    this->lastQueued = queued;
+    this->backlogBytes = this->bytesConsumed;
+    this->backlogTime = now;
+}
+
+/* Set the SCHED_FIFO priority (0 to leave the policy alone) and CPU list (empty or NULL for
+   any CPU) of the acquisition thread and of the worker threads. Each thread picks up its
+   new schedule itself: the acquisition thread when acquisition next starts, the workers
+   the next time they are given work. The control port's command thread is not affected */
+void dtacq_adc::setScheduling(int readerPriority, const char *readerCpus, int workerPriority, const char *workerCpus)
+{
+    DtacqSchedule workerSchedule;
+    dtacqSetSchedule(&workerSchedule, workerPriority, workerCpus);
+    this->workerPool->setSchedule(&workerSchedule);
+    this->lock();
+    dtacqSetSchedule(&this->readerSchedule, readerPriority, readerCpus);
+    this->readerScheduleGeneration++;
+    this->unlock();
+}
+
+/* Apply any new schedule to the calling (acquisition) thread, then measure how late it
+   wakes from short sleeps under that schedule. Results go to SCHED_STATUS and READER_LATENCY.
+   NOTE: The caller of this function must have taken the mutex */
+void dtacq_adc::applyReaderSchedule()
+{
+    const char *functionName = "applyReaderSchedule";
+    if (this->readerScheduleApplied != this->readerScheduleGeneration) {
+        char message[bufferSize];
+        if (dtacqApplySchedule(&this->readerSchedule, message, sizeof(message)))
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s: %s\n",
+                      driverName, functionName, message);
+        setStringParam(DtacqSchedStatus, message);
+        this->readerScheduleApplied = this->readerScheduleGeneration;
+    }
+    this->workerPool->resetLatency();
+    this->unlock();
+    double latency = dtacqProbeLatency(DTACQ_LATENCY_PROBES, DTACQ_LATENCY_INTERVAL);
+    this->lock();
+    setDoubleParam(DtacqReaderLatency, latency);
 }
 
 /* This thread calls computeImage to compute new image data and does the
@@ -463,6 +1627,12 @@ void dtacq_adc::dtacqTask()
             this->unlock();
             acquireStartEvent->wait();
             this->lock();
+            applyReaderSchedule();
+            dtacqArena::threadFaults(&this->faultBaseMinor, &this->faultBaseMajor);
+            resetBacklog();
+            this->windowRing->restart();
+            this->frameSizer->reset();
+            this->lastReadValid = false;
             acquire = 1;
             setStringParam(ADStatusMessage, "Acquiring data");
             setIntegerParam(ADNumImagesCounter, 0);
@@ -485,8 +1655,36 @@ void dtacq_adc::dtacqTask()
 
         epicsTimeGetCurrent(&startTime);
         /* Update the image */
+        uint64_t droppedBefore = this->droppedSamples;
         status = computeImage();
+        long minorFaults, majorFaults;
+        dtacqArena::threadFaults(&minorFaults, &majorFaults);
+        this->readerMinorFaults = minorFaults - this->faultBaseMinor;
+        this->readerMajorFaults = majorFaults - this->faultBaseMajor;
 
+        if (status) {
+            /* A window must not span the gap left by a lost frame, nor a frame interval */
+            this->windowRing->restart();
+            if (this->droppedSamples > droppedBefore)
+                this->windowRing->skipSamples((double)(this->droppedSamples - droppedBefore));
+            this->lastReadValid = false;
+        }
+        if (status == asynOverflow) {
+            /* Frame was dropped by the overflow policy; keep reading */
+            callParamCallbacks();
+            continue;
+        }
+        if (status && this->replayEnded) {
+            /* The end of a replayed capture completes the acquisition */
+            this->replayEnded = false;
+            setStringParam(ADStatusMessage, "Replay finished");
+            setIntegerParam(ADStatus, ADStatusIdle);
+            setIntegerParam(ADAcquire, 0);
+            this->closeSocket();
+            callParamCallbacks();
+            acquire = 0;
+            continue;
+        }
         if (status) {
 	    if (status == asynDisconnected)
 		setIntegerParam(ADStatus, ADStatusDisconnected);
@@ -513,23 +1711,39 @@ void dtacq_adc::dtacqTask()
         setIntegerParam(NDArrayCounter, imageCounter);
         setIntegerParam(ADNumImagesCounter, numImagesCounter);
 
-        /* Put the frame number and time stamp into the buffer */
-        pImage->uniqueId = imageCounter;
-        pImage->timeStamp = startTime.secPastEpoch + startTime.nsec / 1.e9;
-
-        /* Get any attributes that have been defined for this driver */
-        this->getAttributes(pImage->pAttributeList);
+        int compress;
+        getIntegerParam(DtacqCompress, &compress);
+        if (compress && this->pRaw)
+            publishCompressed(imageCounter, startTime, arrayCallbacks);
+        if (this->publishFrame && this->pRaw)
+            publishSites(imageCounter, startTime, arrayCallbacks);
+
+        if (!this->publishFrame) pImage = NULL;
+        if (pImage) {
+            /* Put the frame number and time stamp into the buffer */
+            pImage->uniqueId = imageCounter;
+            pImage->timeStamp = startTime.secPastEpoch + startTime.nsec / 1.e9;
+
+            /* Get any attributes that have been defined for this driver */
+            this->getAttributes(pImage->pAttributeList);
+        }
 
-        if (arrayCallbacks) {
+        if (arrayCallbacks && pImage) {
             /* Call the NDArray callback */
             /* Must release the lock here, or we can get into a deadlock, because we can
                block on the plugin lock, and the plugin can be calling us */
             this->unlock();
             asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
                       "%s:%s: calling imageData callback\n", driverName, functionName);
-            doCallbacksGenericPointer(pImage, NDArrayData, 0);
+            doCallbacksGenericPointer(pImage, NDArrayData, DTACQ_FRAME_ADDR);
             this->lock();
         }
+        if (pImage) {
+            publishWindows(pImage, startTime, arrayCallbacks);
+            publishSpectrum(pImage, startTime, arrayCallbacks);
+            publishShm(pImage, startTime);
+        }
+        adaptFrameLength();
         getIntegerParam(ADImageMode, &imageMode);
         /* See if acquisition is done */
         if ((imageMode == ADImageSingle) ||
@@ -546,27 +1760,85 @@ void dtacq_adc::dtacqTask()
                       "%s:%s: acquisition completed\n", driverName,
                       functionName);
         }
+        double meanLatency, maxLatency;
+        this->workerPool->getLatency(&meanLatency, &maxLatency);
+        setDoubleParam(DtacqWorkerLatency, meanLatency);
+        setDoubleParam(DtacqWorkerLatencyMax, maxLatency);
         /* Call the callbacks to update any changes */
         callParamCallbacks();
     }
 }
 
-asynStatus dtacq_adc::getSiteInformation()
+/* Read the module type and manufacturer of the master site, and the module type and channel
+   count of each site in siteList (AGGR_SITES). Each value is a round trip on the control port,
+   so this is called from the command queue's thread.
+   NOTE: The caller of this function must NOT hold the mutex */
+void dtacq_adc::readSiteInformation(int master, const char *siteList, DtacqSiteInfo *info)
 {
     int eomReason;
     size_t commandLen;
     size_t nbytesIn, nbytesOut;
     char command[bufferSize], readBuffer[bufferSize];
-    int status = asynSuccess;
-    epicsInt32 master;
-    status = getIntegerParam(this->DtacqMasterSite, &master);
+    info->moduleType = 0;
+    info->manufacturer.clear();
+    info->sites.clear();
     commandLen = sprintf(command, "get.site %d module_type\n", master);
-    pasynOctetSyncIO->writeRead(controlIPPort, (const char*)command, commandLen,
-                                readBuffer, bufferSize, 2.0,
-                                &nbytesIn, &nbytesOut, &eomReason);
-    int moduleType;
-    sscanf(readBuffer, "%d", &moduleType);
-    switch (moduleType)
+    if (pasynOctetSyncIO->writeRead(controlIPPort, (const char*)command, commandLen,
+                                    readBuffer, bufferSize, 2.0,
+                                    &nbytesOut, &nbytesIn, &eomReason) == asynSuccess && nbytesIn > 0)
+        sscanf(readBuffer, "%d", &info->moduleType);
+
+    commandLen = sprintf(command, "get.site %d MANUFACTURER\n", master);
+    if (pasynOctetSyncIO->writeRead(controlIPPort, (const char*)command, commandLen,
+                                    readBuffer, bufferSize, 2.0,
+                                    &nbytesOut, &nbytesIn, &eomReason) == asynSuccess && nbytesIn > 0)
+        info->manufacturer = readBuffer;
+
+    /* Work out which columns of the aggregated stream belong to which module. Each site
+       contributes NCHAN consecutive channels, in the order the sites are listed in AGGR_SITES */
+    int firstColumn = 0;
+    const char *pNext = siteList;
+    while (*pNext && (int)info->sites.size() < DTACQ_MAX_SITES) {
+        char *pEnd;
+        long site = strtol(pNext, &pEnd, 10);
+        if (pEnd == pNext) {
+            pNext++;
+            continue;
+        }
+        pNext = pEnd;
+        DtacqSite siteInfo;
+        siteInfo.site = (int)site;
+        siteInfo.moduleType = 0;
+        siteInfo.nChannels = 0;
+        siteInfo.firstColumn = firstColumn;
+        commandLen = sprintf(command, "get.site %ld module_type\n", site);
+        if (pasynOctetSyncIO->writeRead(controlIPPort, (const char*)command, commandLen,
+                                        readBuffer, bufferSize, 2.0,
+                                        &nbytesOut, &nbytesIn, &eomReason) == asynSuccess && nbytesIn > 0)
+            sscanf(readBuffer, "%d", &siteInfo.moduleType);
+        commandLen = sprintf(command, "get.site %ld NCHAN\n", site);
+        if (pasynOctetSyncIO->writeRead(controlIPPort, (const char*)command, commandLen,
+                                        readBuffer, bufferSize, 2.0,
+                                        &nbytesOut, &nbytesIn, &eomReason) == asynSuccess && nbytesIn > 0)
+            sscanf(readBuffer, "%d", &siteInfo.nChannels);
+        if (siteInfo.nChannels <= 0) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                      "%s:readSiteInformation unable to read the channel count of site %ld\n",
+                      driverName, site);
+            info->sites.clear();
+            break;
+        }
+        firstColumn += siteInfo.nChannels;
+        info->sites.push_back(siteInfo);
+    }
+}
+
+/* Publish site information read by readSiteInformation() and rescale for the modules found.
+   NOTE: The caller of this function must have taken the mutex */
+asynStatus dtacq_adc::applySiteInformation(const DtacqSiteInfo *info)
+{
+    int status = asynSuccess;
+    switch (info->moduleType)
     {
       case ACQ420:
 	status = setStringParam(ADModel, "acq420fmc");
@@ -581,80 +1853,266 @@ asynStatus dtacq_adc::getSiteInformation()
 	status = setStringParam(ADModel, "unknown");
 	break;
     }
-
-    commandLen = sprintf(command, "get.site %d MANUFACTURER\n", master);
-    pasynOctetSyncIO->writeRead(controlIPPort, (const char*)command, commandLen,
-                                readBuffer, bufferSize, 2.0,
-                                &nbytesIn, &nbytesOut, &eomReason);
-    status |= setStringParam(ADManufacturer, readBuffer);
+    status |= setStringParam(ADManufacturer, info->manufacturer.c_str());
+
+    this->sites = info->sites;
+    for (int s = 0; s < DTACQ_MAX_SITES; s++) {
+        bool used = s < (int)this->sites.size();
+        setIntegerParam(DTACQ_SITE_ADDR + s, DtacqSiteNumber, used ? this->sites[s].site : 0);
+        setIntegerParam(DTACQ_SITE_ADDR + s, DtacqSiteModule, used ? this->sites[s].moduleType : 0);
+        setIntegerParam(DTACQ_SITE_ADDR + s, DtacqSiteChannels, used ? this->sites[s].nChannels : 0);
+        callParamCallbacks(DTACQ_SITE_ADDR + s);
+    }
+    /* Each module is scaled according to its own range table */
+    updateCalibration();
     return (asynStatus)status;
 }
 
-/* Send a command to the controls port (in native notation) */
-asynStatus dtacq_adc::setDeviceParameter(const char *parameter, const char *value, const char *site)
+/* Parse a whitespace separated list of numbers as returned by the control port */
+static void parseValueList(const char *buffer, std::vector<double> *values)
 {
-    size_t commandLen;
-    size_t nbytesOut;
-    char command[bufferSize];
-    int status = asynSuccess;
-    if (site==NULL) {
-        epicsInt32 master;
-        status = getIntegerParam(this->DtacqMasterSite, &master);
-        commandLen = sprintf(command, "set.site %d %s %s\n", master, parameter, value);
-    } else {
-        commandLen = sprintf(command, "set.site %s %s %s\n", site, parameter, value);
+    char *end;
+    values->clear();
+    for (const char *p = buffer; *p; p = end) {
+        double value = strtod(p, &end);
+        if (end == p) {
+            /* Skip anything that is not a number */
+            end = (char *)p + 1;
+            continue;
+        }
+        values->push_back(value);
     }
-    asynPrint(this->pasynUserSelf, ASYN_TRACEIO_DRIVER, "setDevParam: %s\n",
-              command);
-    status |= pasynOctetSyncIO->write(controlIPPort, (const char*) command,
-                                      commandLen, 2.0, &nbytesOut);
-    return (asynStatus)status;
 }
 
-/* Read a device parameter from the controls port (in native notation) */
-asynStatus dtacq_adc::getDeviceParameter(const char *parameter,
-                                         char *readBuffer, int bufferLen, const char *site)
+/* Queue a command to the controls port (in native notation). This returns at once; the
+   command is sent by the command queue and commandDone() is called with tag and arg
+   when it has completed. A set that is still queued is replaced by a newer one.
+   NOTE: The caller of this function must have taken the mutex */
+asynStatus dtacq_adc::setDeviceParameter(const char *parameter, const char *value, const char *site,
+                                         int tag, int arg)
 {
-    int eomReason;
-    size_t commandLen;
-    size_t nbytesIn, nbytesOut;
-    char command[bufferSize];
-    int status = asynSuccess;
-    if (site==NULL) {
-        epicsInt32 master;
-        status = getIntegerParam(this->DtacqMasterSite, &master);
-        commandLen = sprintf(command, "get.site %d %s\n", master, parameter);
-    } else {
-	commandLen = sprintf(command, "get.site %s %s\n", site, parameter);
+    char master[16];
+    if (this->commandQueue == NULL) return asynDisconnected;
+    if (site == NULL) {
+        epicsInt32 masterSite;
+        getIntegerParam(this->DtacqMasterSite, &masterSite);
+        epicsSnprintf(master, sizeof(master), "%d", masterSite);
+        site = master;
     }
+    asynPrint(this->pasynUserSelf, ASYN_TRACEIO_DRIVER, "setDevParam: set.site %s %s %s\n",
+              site, parameter, value);
+    this->commandQueue->set(site, parameter, value, tag, arg);
+    return asynSuccess;
+}
 
-    std::cout << "bufferLen = " << bufferLen << std::endl;
-    std::cout << "command = " << command << std::endl;
-    asynPrint(this->pasynUserSelf, ASYN_TRACEIO_DRIVER, "getDevParam: %s\n",
-              command);
-    status |= pasynOctetSyncIO->writeRead(controlIPPort, (const char*) command,
-                                          commandLen, readBuffer, bufferLen,
-                                          2.0, &nbytesIn, &nbytesOut, &eomReason);
-    return (asynStatus)status;
+/* Queue a read of a device parameter from the controls port (in native notation).
+   The reply is passed to commandDone() with tag and arg.
+   NOTE: The caller of this function must have taken the mutex */
+asynStatus dtacq_adc::requestDeviceParameter(const char *parameter, int tag, int arg, const char *site)
+{
+    char master[16];
+    if (this->commandQueue == NULL) return asynDisconnected;
+    if (site == NULL) {
+        epicsInt32 masterSite;
+        getIntegerParam(this->DtacqMasterSite, &masterSite);
+        epicsSnprintf(master, sizeof(master), "%d", masterSite);
+        site = master;
+    }
+    asynPrint(this->pasynUserSelf, ASYN_TRACEIO_DRIVER, "getDevParam: get.site %s %s\n",
+              site, parameter);
+    this->commandQueue->get(site, parameter, tag, arg);
+    return asynSuccess;
+}
+
+/* Publish the command queue statistics.
+   NOTE: The caller of this function must have taken the mutex */
+void dtacq_adc::updateCommandStats()
+{
+    if (this->commandQueue == NULL) return;
+    DtacqCommandStats stats;
+    this->commandQueue->getStats(&stats);
+    setIntegerParam(DtacqCmdPending, this->commandQueue->pending());
+    setIntegerParam(DtacqCmdCount, stats.count);
+    setIntegerParam(DtacqCmdCoalesced, stats.coalesced);
+    setIntegerParam(DtacqCmdErrors, stats.errors);
+    setDoubleParam(DtacqCmdLatency, stats.lastLatency * 1e3);
+    setDoubleParam(DtacqCmdLatencyMean, stats.meanLatency * 1e3);
+    setDoubleParam(DtacqCmdLatencyMax, stats.maxLatency * 1e3);
+}
+
+/* Called on the command queue's thread when a queued command has completed.
+   NOTE: The caller of this function must NOT hold the mutex */
+void dtacq_adc::commandDone(const DtacqCommand *command)
+{
+    const char *functionName = "commandDone";
+    int acquiring;
+    DtacqSiteInfo siteInfo;
+    bool haveSites = false;
+    bool armed = false;
+    if (command->tag == DtacqCmdSites || command->tag == DtacqCmdStart) {
+        /* Site discovery takes several round trips on the control port; do it without the
+           lock so records and the acquisition thread are not held up, then apply it below */
+        int master;
+        char siteList[STRINGLEN];
+        this->lock();
+        getIntegerParam(ADAcquire, &acquiring);
+        haveSites = command->tag == DtacqCmdSites ||
+                    (acquiring && command->arg == this->acquireGeneration);
+        getIntegerParam(DtacqMasterSite, &master);
+        getStringParam(DtacqAggregationSites, STRINGLEN, siteList);
+        this->unlock();
+        if (haveSites) readSiteInformation(master, siteList, &siteInfo);
+    }
+    this->lock();
+    if (command->status != asynSuccess)
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s control command %s %s failed, status=%d\n",
+                  driverName, functionName, command->parameter.c_str(), command->value.c_str(), command->status);
+    switch (command->tag) {
+    case DtacqCmdDataType: {
+        /* Update our own data type to match what the device reports, regardless of whether the
+           change we made was successful; at least for the ACQ437 trying to change the data type
+           from int32 to int16 fails outright */
+        int dType;
+        if (command->status == asynSuccess && sscanf(command->reply.c_str(), "%d", &dType) == 1) {
+            int actual = (dType == 0) ? NDInt16 : NDInt32;
+            if (dType == 0 || dType == 1) setIntegerParam(NDDataType, actual);
+            if (actual != command->arg)
+                asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s Failed to set data type to %s: %s\n",
+                          driverName, functionName, (command->arg == NDInt16) ? "NDInt16" : "NDInt32",
+                          command->reply.c_str());
+        }
+        /* Update our conversion factor and data size since these are dependent on the data type */
+        int gainSel = -1;
+        getIntegerParam(DtacqGain, &gainSel);
+        if (calculateConversionFactor(gainSel, &count2volt) == asynSuccess)
+            calculateDataSize();
+        updateCalibration();
+        break;
+    }
+    case DtacqCmdScratchpad: {
+        /* Update our internal state only if the unit confirms the change. The reply is
+           "<enable>,<# words>,<DIX>"; older firmware may only report the enable */
+        int setSpad, spadWords, dix;
+        int nRead = (command->status == asynSuccess)
+            ? sscanf(command->reply.c_str(), "%d%*[, ]%d%*[, ]%d", &setSpad, &spadWords, &dix) : 0;
+        if (nRead >= 1) {
+            setIntegerParam(DtacqEnableScratchpad, setSpad);
+            if (nRead >= 2) setIntegerParam(DtacqSpadWords, spadWords);
+            if (nRead >= 3) setIntegerParam(DtacqSpadDix, dix);
+            if (setSpad == command->arg)
+                calculateDataSize();
+            else
+                asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s Failed to set scratchpad: %s\n",
+                          driverName, functionName, command->reply.c_str());
+        }
+        break;
+    }
+    case DtacqCmdCalSlope:
+    case DtacqCmdCalOffset: {
+        /* Ignore replies for a request that has already been given up on */
+        std::map<int, DtacqCalibration>::iterator pending = this->calibrationPending.find(command->arg);
+        if (pending == this->calibrationPending.end()) break;
+        int nChannels;
+        getIntegerParam(DtacqChannels, &nChannels);
+        std::vector<double> *values = (command->tag == DtacqCmdCalSlope) ? &pending->second.eslo : &pending->second.eoff;
+        if (command->status == asynSuccess) {
+            parseValueList(command->reply.c_str(), values);
+            /* The carrier prefixes the channel values with bookkeeping fields; keep the last nChannels */
+            if ((int)values->size() > nChannels)
+                values->erase(values->begin(), values->end() - nChannels);
+        }
+        if (command->tag == DtacqCmdCalSlope) break;
+        /* The offsets are requested after the slopes, so both have now arrived */
+        int source;
+        getIntegerParam(DtacqCalSource, &source);
+        if (pending->second.eslo.empty() || pending->second.eoff.empty())
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s failed to load calibration for range %d, using nominal scaling\n",
+                      driverName, functionName, command->arg);
+        else if (source == DtacqCalCarrier)
+            this->calibrationCache[command->arg] = pending->second;
+        this->calibrationPending.erase(pending);
+        updateCalibration();
+        break;
+    }
+    case DtacqCmdSites:
+        applySiteInformation(&siteInfo);
+        break;
+    case DtacqCmdStart: {
+        char sites[STRINGLEN], line[STRINGLEN + 8];
+        /* A stop, or a later start, may have superseded this start while it was queued */
+        getIntegerParam(ADAcquire, &acquiring);
+        if (!haveSites || !acquiring || command->arg != this->acquireGeneration) break;
+        applySiteInformation(&siteInfo);
+        getStringParam(DtacqAggregationSites, STRINGLEN, sites);
+        epicsSnprintf(line, sizeof(line), "run0 %s", sites);
+        this->commandQueue->send(line, DtacqCmdArm, command->arg);
+        break;
+    }
+    case DtacqCmdArm:
+        /* Acquisition may have been stopped, or restarted, while the carrier was being armed */
+        getIntegerParam(ADAcquire, &acquiring);
+        if (!acquiring || command->arg != this->acquireGeneration) break;
+        if (command->status != asynSuccess) {
+            setIntegerParam(ADAcquire, 0);
+            setIntegerParam(ADStatus, ADStatusError);
+            setStringParam(ADStatusMessage, "Unable to start the carrier");
+            break;
+        }
+        /* The data port users are kept for the life of the driver; closeSocket() only disconnects */
+        if (this->octetDataIPPort == NULL)
+            pasynOctetSyncIO->connect(this->dataPortName, -1,
+                                      &this->octetDataIPPort, NULL);
+        if (this->commonDataIPPort == NULL)
+            pasynCommonSyncIO->connect(this->dataPortName, -1,
+                                       &this->commonDataIPPort, NULL);
+        pasynManager->autoConnect(this->commonDataIPPort, 1);
+        armed = true;
+        break;
+    default:
+        break;
+    }
+    updateCommandStats();
+    callParamCallbacks();
+    this->unlock();
+    if (armed) {
+        /* Open the data connection and find its descriptor for the backlog monitor once per
+           start; the search walks every descriptor, so it is done without the lock */
+        pasynCommonSyncIO->connectDevice(this->commonDataIPPort);
+        int fd = dtacqFindSocket(this->dataHostInfo);
+        this->lock();
+        getIntegerParam(ADAcquire, &acquiring);
+        if (acquiring && command->arg == this->acquireGeneration) {
+            if (fd < 0)
+                asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                          "%s:%s data connection to %s not found, receive queue will not be monitored\n",
+                          driverName, functionName, this->dataHostInfo);
+            this->dataSocket = fd;
+            acquireStartEvent->signal();
+        }
+        this->unlock();
+    }
 }
 
 /* Calculate the scaling factor to convert from raw values to voltages within the current range */
 asynStatus dtacq_adc::calculateConversionFactor(int gainSelection, double *factor) {
-    const char *functionName = "calculateConversionFactor";
+    return moduleConversionFactor(this->moduleType, gainSelection, factor);
+}
+
+/* As calculateConversionFactor, for a module of the given type (used for each site of a mixed stream) */
+asynStatus dtacq_adc::moduleConversionFactor(int module, int gainSelection, double *factor) {
+    const char *functionName = "moduleConversionFactor";
     asynStatus status;
     int nbits;
-    double inRange, outRange;
     getIntegerParam(NDDataType, &nbits);
     if (nbits == 2) nbits = 16;
     else nbits = 32;
     try {
-        inRange = pow(2, nbits);
-        outRange = 2 * this->ranges.at(this->moduleType).at(gainSelection);
-        *factor = outRange / inRange;
+        *factor = dtacqCountToVolts(this->ranges.at(module).at(gainSelection), nbits);
         status = asynSuccess;
     } catch (const std::out_of_range& oor) {
         asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s caught out_of_range exception, received moduleType=%d, gainSelection=%d\n",
-            driverName, functionName, moduleType, gainSelection);
+            driverName, functionName, module, gainSelection);
         status = asynError;
     }
     return status;
@@ -666,45 +2124,194 @@ asynStatus dtacq_adc::calculateDataSize()
   const char *functionName = "calculateDataSize";
   int status = asynSuccess;
 
-  int nChannels, spad, dType;
+  int dType;
+  DtacqFrameLayout layout;
+  getIntegerParam(NDDataType, &dType);
+  getFrameLayout((dType == NDInt16) ? 2 : 4, &layout);
+  asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s:%s nChannels %d, spad words %d, DIX %d, datatype %d\n",
+            driverName, functionName, layout.nChannels, layout.spadWords, layout.dix, dType);
+  int width = dtacqRowWidth(&layout);
+  status |= setIntegerParam(ADMaxSizeX, width);
+  status |= setIntegerParam(ADSizeX, width);
+  status |= setIntegerParam(NDArraySizeX, width);
+  return (asynStatus)status;
+}
+
+/* The row layout for the current channel count and scratchpad settings, with wordBytes
+   bytes per word.
+   NOTE: The caller of this function must have taken the mutex */
+void dtacq_adc::getFrameLayout(int wordBytes, DtacqFrameLayout *layout)
+{
+  int nChannels, spad, spadWords, dix;
   getIntegerParam(DtacqChannels, &nChannels);
   getIntegerParam(DtacqEnableScratchpad, &spad);
-  getIntegerParam(NDDataType, &dType);
-  asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s:%s nChannels %d, spad %d, datatype %d\n", driverName, functionName, nChannels, spad, dType);
-  if (spad && dType == 2) {
-      status |= setIntegerParam(ADMaxSizeX, nChannels + 2);
-      status |= setIntegerParam(ADSizeX, nChannels + 2);
-      status |= setIntegerParam(NDArraySizeX, nChannels + 2);
-  } else if (spad) {
-      status |= setIntegerParam(ADMaxSizeX, nChannels + 1);
-      status |= setIntegerParam(ADSizeX, nChannels + 1);
-      status |= setIntegerParam(NDArraySizeX, nChannels + 1);
-  } else {
-      status |= setIntegerParam(ADMaxSizeX, nChannels);
-      status |= setIntegerParam(ADSizeX, nChannels);
-      status |= setIntegerParam(NDArraySizeX, nChannels);
+  getIntegerParam(DtacqSpadWords, &spadWords);
+  getIntegerParam(DtacqSpadDix, &dix);
+  if (spadWords < 1) spadWords = 1;
+  dtacqSetLayout(layout, wordBytes, nChannels, spad ? spadWords : 0, dix);
+}
+
+/* Attach the scratchpad words of the frame's first sample to pFrame as SpadN attributes,
+   plus DigitalInputs when DIX is set. Only one row is read, so this costs nothing per sample.
+   NOTE: The caller of this function must have taken the mutex */
+void dtacq_adc::addSpadAttributes(NDArray *pFrame)
+{
+  const DtacqFrameLayout *layout = &this->frameLayout;
+  if (layout->spadWords == 0 || this->pRaw == NULL) return;
+  epicsUInt32 spad[DTACQ_MAX_SPAD_WORDS];
+  char name[16], description[64];
+  dtacqReadSpad(this->pRaw->pData, layout, spad);
+  for (int n = 0; n < layout->spadWords; n++) {
+      epicsSnprintf(name, sizeof(name), "Spad%d", n);
+      epicsSnprintf(description, sizeof(description), "Scratchpad word %d of the first sample", n);
+      pFrame->pAttributeList->add(name, description, NDAttrUInt32, &spad[n]);
   }
-  return (asynStatus)status;
+  if (layout->dix)
+      pFrame->pAttributeList->add("DigitalInputs", "Digital inputs at the first sample",
+                                  NDAttrUInt32, &spad[layout->spadWords - 1]);
 }
 
-/* Scale every value in pFrame to fit the current voltage range.
-   Assumes type Float64 for pFrame contents */
-asynStatus dtacq_adc::applyScaling(NDArray *pFrame, int nChannels, int skipCount) {
+/* Scale the channels of the raw frame pIn starting at firstChannel to volts within the
+   current range, writing them into pOut. Assumes type Int16 or Int32 for pIn and Float64
+   for pOut, with the same number of rows; pOut's width sets how many channels are taken.
+   NOTE: The caller of this function must have taken the mutex */
+asynStatus dtacq_adc::applyScaling(NDArray *pIn, NDArray *pOut, int firstChannel, int skipCount) {
     const char *functionName = "applyScaling";
-    if (pFrame == NULL) {
-        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s unable to apply scaling, pFrame is NULL\n", driverName, functionName);
+    if (pIn == NULL || pOut == NULL) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s unable to apply scaling, frame is NULL\n", driverName, functionName);
         return asynError;
-    } else {
-        double *pDoubles = (double *)(pFrame->pData);
-        for (int i = 0; i < this->nElements(pFrame); i++) {
-            // Skip any elements which are actually the sample count
-            if (skipCount && i % (nChannels + skipCount) == nChannels)
-              continue;
+    }
+    int inWidth = (int)pIn->dims[0].size;
+    int outWidth = (int)pOut->dims[0].size;
+    if (firstChannel < 0 || firstChannel + outWidth > inWidth) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s channels %d-%d outside raw frame of %d\n",
+                  driverName, functionName, firstChannel, firstChannel + outWidth - 1, inWidth);
+        return asynError;
+    }
+    int nData = dtacqDataColumns(inWidth, skipCount, firstChannel, outWidth, (int)this->frameScale.size());
+    const double *scale = &this->frameScale[0] + firstChannel;
+    const double *offset = &this->frameOffset[0] + firstChannel;
+    size_t nSamples = this->nElements(pIn) / inWidth;
+    /* Use the kernel instance compiled for the number of scratchpad columns being copied */
+    if (pIn->dataType == NDInt16)
+        dtacqToVolts<epicsInt16>::select(outWidth - nData)(
+                   (const epicsInt16 *)pIn->pData + firstChannel, (double *)pOut->pData, nSamples,
+                   inWidth, outWidth, nData, (epicsInt16)~0, scale, offset);
+    else
+        dtacqToVolts<epicsInt32>::select(outWidth - nData)(
+                   (const epicsInt32 *)pIn->pData + firstChannel, (double *)pOut->pData, nSamples,
+                   inWidth, outWidth, nData, (epicsInt32)this->bitMask, scale, offset);
+    return asynSuccess;
+}
+
+/* Read the per-channel calibration for gainSelection from a local file.
+   Slopes are in volts per code as reported by the carrier, offsets in volts.
+   The carrier's own calibration is read asynchronously, see requestCarrierCalibration() */
+asynStatus dtacq_adc::loadCalibration(int source, int gainSelection, DtacqCalibration *cal)
+{
+    const char *functionName = "loadCalibration";
+    int nChannels;
+    getIntegerParam(DtacqChannels, &nChannels);
+    cal->eslo.clear();
+    cal->eoff.clear();
+    if (source == DtacqCalFile) {
+        char fileTemplate[STRINGLEN], fileName[STRINGLEN], line[STRINGLEN];
+        getStringParam(DtacqCalFile, STRINGLEN, fileTemplate);
+        /* The file name may contain %d, which is replaced by the range selection */
+        epicsSnprintf(fileName, STRINGLEN, fileTemplate, gainSelection);
+        FILE *fp = fopen(fileName, "r");
+        if (fp == NULL) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s unable to open calibration file %s\n",
+                      driverName, functionName, fileName);
+            return asynError;
+        }
+        /* One line per channel: <channel> <slope> <offset>, '#' starts a comment */
+        while (fgets(line, STRINGLEN, fp)) {
+            int channel;
+            double slope, offset;
+            if (line[0] == '#' || sscanf(line, "%d %lf %lf", &channel, &slope, &offset) != 3)
+                continue;
+            if (channel < 0 || channel >= nChannels) continue;
+            if ((int)cal->eslo.size() <= channel) {
+                cal->eslo.resize(channel + 1, 0.0);
+                cal->eoff.resize(channel + 1, 0.0);
+            }
+            cal->eslo[channel] = slope;
+            cal->eoff[channel] = offset;
+        }
+        fclose(fp);
+    }
+    return cal->eslo.empty() ? asynError : asynSuccess;
+}
+
+/* Ask the carrier for its calibration of range gainSelection. Nominal scaling is used
+   until commandDone() has both lists, then the tables are rebuilt.
+   NOTE: The caller of this function must have taken the mutex */
+void dtacq_adc::requestCarrierCalibration(int gainSelection)
+{
+    if (this->calibrationPending.count(gainSelection)) return;
+    if (requestDeviceParameter("AI:CAL:ESLO", DtacqCmdCalSlope, gainSelection) != asynSuccess) return;
+    requestDeviceParameter("AI:CAL:EOFF", DtacqCmdCalOffset, gainSelection);
+    this->calibrationPending[gainSelection] = DtacqCalibration();
+}
+
+/* Rebuild the per-channel slope and offset tables used by the conversion kernel from
+   count2volt and the (cached) calibration for the current range. Polarity inversion
+   is folded in here as a sign on the slope and offset, so it costs nothing per sample.
+   NOTE: The caller of this function must have taken the mutex */
+void dtacq_adc::updateCalibration()
+{
+    const char *functionName = "updateCalibration";
+    int source, gainSel, maxSizeX, dType, invert, invertMask, nCalibrated = 0;
+    getIntegerParam(DtacqCalSource, &source);
+    getIntegerParam(DtacqAdcInvert, &invert);
+    getIntegerParam(DtacqInvertMask, &invertMask);
+    getIntegerParam(DtacqGain, &gainSel);
+    getIntegerParam(ADMaxSizeX, &maxSizeX);
+    getIntegerParam(NDDataType, &dType);
+    std::map<int, DtacqCalibration>::iterator cal = this->calibrationCache.end();
+    if (source != DtacqCalNone) {
+        cal = this->calibrationCache.find(gainSel);
+        if (cal == this->calibrationCache.end() && source == DtacqCalCarrier) {
+            requestCarrierCalibration(gainSel);
+        } else if (cal == this->calibrationCache.end()) {
+            DtacqCalibration loaded;
+            if (loadCalibration(source, gainSel, &loaded) == asynSuccess)
+                cal = this->calibrationCache.insert(std::make_pair(gainSel, loaded)).first;
             else
-              pDoubles[i] = pDoubles[i] * this->count2volt;
+                asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s failed to load calibration for range %d, using nominal scaling\n",
+                          driverName, functionName, gainSel);
         }
-        return asynSuccess;
     }
+    this->channelScale.assign(maxSizeX, this->count2volt);
+    this->channelOffset.assign(maxSizeX, 0.0);
+    /* In a mixed stream each module's channels take the nominal scaling of that module type */
+    for (size_t s = 0; s < this->sites.size(); s++) {
+        double siteScale;
+        if (moduleConversionFactor(this->sites[s].moduleType, gainSel, &siteScale) != asynSuccess)
+            continue;
+        for (int c = this->sites[s].firstColumn;
+             c < this->sites[s].firstColumn + this->sites[s].nChannels && c < maxSizeX; c++)
+            this->channelScale[c] = siteScale;
+    }
+    if (cal != this->calibrationCache.end()) {
+        /* Slopes are quoted per code of the ADC; in 32 bit mode the 24 bit code sits above the site/channel byte */
+        double codeScale = (dType == NDInt16) ? 1.0 : 1.0 / 256.0;
+        for (size_t c = 0; c < cal->second.eslo.size() && c < cal->second.eoff.size() && (int)c < maxSizeX; c++) {
+            if (cal->second.eslo[c] == 0.0) continue;
+            this->channelScale[c] = cal->second.eslo[c] * codeScale;
+            this->channelOffset[c] = cal->second.eoff[c];
+            nCalibrated++;
+        }
+    }
+    /* INVERT flips every channel; INVERT_MASK selects channels (bit 0 is channel 1) */
+    for (int c = 0; c < maxSizeX; c++) {
+        if (invert || (c < 32 && (((epicsUInt32)invertMask >> c) & 1))) {
+            this->channelScale[c] = -this->channelScale[c];
+            this->channelOffset[c] = -this->channelOffset[c];
+        }
+    }
+    setIntegerParam(DtacqCalChannels, nCalibrated);
 }
 
 /* Apply the bit mask that deletes the site and channel number embedded in the raw values.
@@ -715,13 +2322,9 @@ asynStatus dtacq_adc::applyBitMask(NDArray *pFrame, int nChannels, int skipCount
 	asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s unable to apply bit mask, pFrame is NULL\n", driverName, functionName);
         return asynError;
     } else {
-        int *pInts = (int *)(pFrame->pData);
-        for (int i = 0; i < this->nElements(pFrame); i++) {
-            if (skipCount && i % (nChannels + skipCount) == nChannels)
-              continue;
-            else
-              pInts[i] = pInts[i] & this->bitMask;
-        }
+        int rowWidth = (int)pFrame->dims[0].size;
+        dtacqMaskData((epicsInt32 *)pFrame->pData, this->nElements(pFrame) / rowWidth, rowWidth,
+                      rowWidth - skipCount, this->bitMask);
 
         return asynSuccess;
     }
@@ -748,13 +2351,18 @@ asynStatus dtacq_adc::writeInt32(asynUser *pasynUser, epicsInt32 value)
     int adstatus;
     int acquiring;
     int imageMode;
-    size_t commandLen, nbytesOut;
     asynStatus status = asynSuccess;
-    char command[9], sites[STRINGLEN];
+    char command[16];
     /* Ensure that ADStatus is set correctly before we set ADAcquire.*/
     getIntegerParam(ADStatus, &adstatus);
     getIntegerParam(ADAcquire, &acquiring);
 
+    if (function == DtacqFftSize && value > 0 && value < 4) {
+        asynPrint(pasynUser, ASYN_TRACE_ERROR,
+                  "%s:writeInt32 FFT_SIZE %d is too short, use 0 (off) or at least 4\n",
+                  driverName, value);
+        return asynError;
+    }
     if (function == ADAcquire) {
         if (value && !acquiring) {
             setStringParam(ADStatusMessage, "Acquiring data");
@@ -782,19 +2390,40 @@ asynStatus dtacq_adc::writeInt32(asynUser *pasynUser, epicsInt32 value)
             sampleCount = 0;
             cleanSampleSeen = false;
 
-	    getSiteInformation();
-
-            getStringParam(DtacqAggregationSites, STRINGLEN, sites);
-            commandLen = sprintf(command, "run0 %s\n", sites);
-
-            pasynOctetSyncIO->write(controlIPPort, command, commandLen, 2,
-                                    &nbytesOut);
-            pasynOctetSyncIO->connect(this->dataPortName, -1,
-                                      &this->octetDataIPPort, NULL);
-            pasynCommonSyncIO->connect(this->dataPortName, -1,
-                                       &this->commonDataIPPort, NULL);
-            pasynManager->autoConnect(this->commonDataIPPort, 1);
-            acquireStartEvent->signal();
+            chunkCounter = 0;
+
+            // The channel ID pattern is relearnt from the first sample of each acquisition.
+            idSignature.clear();
+            realignWords = 0;
+
+            // Overflow accounting is per acquisition.
+            droppedBytes = 0;
+            droppedSamples = 0;
+            setIntegerParam(DtacqDroppedFrames, 0);
+            setDoubleParam(DtacqDroppedBytes, 0.0);
+            setDoubleParam(DtacqDroppedSamples, 0.0);
+            setIntegerParam(DtacqRawFrames, 0);
+            setIntegerParam(DtacqWindowCount, 0);
+            setIntegerParam(DtacqWindowDropped, 0);
+            setIntegerParam(DtacqFftCount, 0);
+            /* The workers may still be accumulating the last frame; see publishSpectrum() */
+            spectrumReset = true;
+
+            getIntegerParam(DtacqReplayMode, &this->replayMode);
+            if (this->replayMode != DtacqReplayOff) {
+                /* Stream a recorded capture through the normal processing path; the carrier is not touched */
+                status = openReplay();
+                if (status == asynSuccess) {
+                    acquireStartEvent->signal();
+                } else {
+                    setIntegerParam(ADAcquire, 0);
+                    setStringParam(ADStatusMessage, "Unable to open replay file");
+                }
+            } else if (this->commandQueue) {
+                /* Reading the sites, arming the carrier and connecting the data port are done
+                   in order with any other queued commands, see commandDone() */
+                this->commandQueue->call(DtacqCmdStart, ++this->acquireGeneration);
+            }
         } else if (!value && acquiring) {
             /* This was a command to stop acquisition */
             /* Send the stop event */
@@ -803,7 +2432,7 @@ asynStatus dtacq_adc::writeInt32(asynUser *pasynUser, epicsInt32 value)
         }
     } else if (function == DtacqMasterSite) {
         setIntegerParam(DtacqMasterSite, value);
-        getSiteInformation();
+        if (this->commandQueue) this->commandQueue->call(DtacqCmdSites, 0);
     } else if (function == NDDataType) {
 	// We can't easily detect the point in the data stream where the data size changes, so to keep things consistent for now we stop
 	// acquisition every time we change this.
@@ -813,52 +2442,38 @@ asynStatus dtacq_adc::writeInt32(asynUser *pasynUser, epicsInt32 value)
 	    this->closeSocket();
 	}
 
-	// First try to set the data type on the device.
+	// First try to set the data type on the device, then read back what the device thinks its data type is now.
+	// The readback updates NDDataType, the conversion factor and the data size (see commandDone()).
         if (value == NDInt16)
-            this->setDeviceParameter("data32", "0");
+            status = this->setDeviceParameter("data32", "0");
         else
-            this->setDeviceParameter("data32", "1");
-
-        // Now read back what the device thinks its data type is now and update our own data type to match (regardless of whether the change we
-        // made was successful; at least for the ACQ437 trying to change the data type from int32 to int16 fails outright).
-        char readBuffer[bufferSize];
-
-        this->getDeviceParameter("data32", readBuffer, bufferSize);
-
-        int dType;
-        if (sscanf(readBuffer, "%d", &dType) == 1) {
-            if (dType==0) {
-        	setIntegerParam(NDDataType, NDInt16);
-        	if (value != NDInt16) {
-        	    asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:writeInt32 Failed to set data type to NDInt16: %s\n", driverName, readBuffer);
-        	    status = asynError;
-        	}
-            } else if (dType==1) {
-        	setIntegerParam(NDDataType, NDInt32);
-        	if (value != NDInt32) {
-        	    asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:writeInt32 Failed to set data type to NDInt32: %s\n", driverName, readBuffer);
-        	    status = asynError;
-        	}
-            }
-        }
-        // Update our conversion factor and data size since these are dependent on the data type.
-        int gainSel = -1;
-        getIntegerParam(DtacqGain, &gainSel);
-        status = calculateConversionFactor(gainSel, &count2volt);
+            status = this->setDeviceParameter("data32", "1");
         if (status == asynSuccess)
-          status = calculateDataSize();
+            status = this->requestDeviceParameter("data32", DtacqCmdDataType, value);
+    } else if (function == DtacqAlignCheck) {
+        /* Switching the check on or off starts again from the next sample's ID pattern */
+        idSignature.clear();
+        realignWords = 0;
     } else if (function == DtacqGain) {
         /* Only do something if the gain is actually adjustable in software */
         if (this->moduleType != 1) {
             /* Gain is set on the carrier site, which propagates it across all modules */
-            char site = '0';
-            // Horrible but convenient misuse of variables command and commandLen...
-            commandLen = sprintf(command, "%d", value);
-            this->setDeviceParameter("gain", command, &site);
+            epicsSnprintf(command, sizeof(command), "%d", value);
+            this->setDeviceParameter("gain", command, "0");
             setIntegerParam(DtacqGain, value);
             status = calculateConversionFactor(value, &count2volt);
+            updateCalibration();
         }
-    } else if (function == DtacqEnableScratchpad) {
+    } else if (function == DtacqCalSource) {
+        /* Changing the source (or re-selecting it) discards the cached tables and reloads */
+        this->calibrationCache.clear();
+        updateCalibration();
+    } else if (function == DtacqCmdReset) {
+        if (value && this->commandQueue) this->commandQueue->resetStats();
+        setIntegerParam(DtacqCmdReset, 0);
+    } else if (function == DtacqAdcInvert || function == DtacqInvertMask) {
+        updateCalibration();
+    } else if (function == DtacqEnableScratchpad || function == DtacqSpadWords || function == DtacqSpadDix) {
 
 	// We can't easily detect the point in the data stream where the sample header is added/removed, so to keep things consistent for now we stop
 	// acquisition every time we change this.
@@ -868,27 +2483,23 @@ asynStatus dtacq_adc::writeInt32(asynUser *pasynUser, epicsInt32 value)
 	    this->closeSocket();
 	}
 	// Command signature is "<enable/disable>,<# words>,<DIX>".
-	// # words can be up to 8 but we only care about the sample count which is in word 1.
-	// DIX seems to be used for digital inputs if the board has these, we don't care about this.
-
-	sprintf(command, "%d,1,0", value);
+	// # words can be up to 8; the sample count is in word 0.
+	// DIX puts the digital inputs, if the board has these, into the last word.
+	int spad, spadWords, dix;
+	getIntegerParam(DtacqEnableScratchpad, &spad);
+	getIntegerParam(DtacqSpadWords, &spadWords);
+	getIntegerParam(DtacqSpadDix, &dix);
+	if (spadWords < 1 || spadWords > DTACQ_MAX_SPAD_WORDS) {
+	    spadWords = (spadWords < 1) ? 1 : DTACQ_MAX_SPAD_WORDS;
+	    setIntegerParam(DtacqSpadWords, spadWords);
+	}
+	epicsSnprintf(command, sizeof(command), "%d,%d,%d", spad ? 1 : 0, spadWords, dix ? 1 : 0);
 	status = this->setDeviceParameter("spad", command, "0");
 
-	// Now interrogate the unit to confirm the change has been written. Update our internal state only if the
-	// write was successful.
-	char readBuffer[bufferSize];
-
-	this->getDeviceParameter("spad", readBuffer, bufferSize, "0");
-
-	int setSpad;
-	if (sscanf(readBuffer, "%d", &setSpad) == 1 && setSpad == value) {
-	    if (status == asynSuccess)
-	      status = calculateDataSize();
-	} else {
-	    asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:writeInt32 Failed to set scratchpad: %s\n", driverName, readBuffer);
-	    status = asynError;
-	}
-	status = setIntegerParam(DtacqEnableScratchpad, setSpad);
+	// Now interrogate the unit to confirm the change has been written. The readback updates our internal
+	// state only if the write was successful (see commandDone()).
+	if (status == asynSuccess)
+	    status = this->requestDeviceParameter("spad", DtacqCmdScratchpad, spad ? 1 : 0, "0");
 
     } else {
         /* If this parameter belongs to a base class call its method */
@@ -896,6 +2507,7 @@ asynStatus dtacq_adc::writeInt32(asynUser *pasynUser, epicsInt32 value)
             status = ADDriver::writeInt32(pasynUser, value);
     }
     /* Do callbacks so higher layers see any changes */
+    updateCommandStats();
     callParamCallbacks();
     if (status)
         asynPrint(pasynUser, ASYN_TRACE_ERROR,
@@ -923,7 +2535,51 @@ void dtacq_adc::report(FILE *fp, int details)
         getIntegerParam(ADSizeY, &ny);
         getIntegerParam(NDDataType, &dataType);
         fprintf(fp, "  NX, NY:            %d  %d\n", nx, ny);
+        int adaptMode;
+        double adaptRate, fixedCost, sampleCost;
+        getIntegerParam(DtacqAdaptMode, &adaptMode);
+        getDoubleParam(DtacqAdaptRate, &adaptRate);
+        frameSizer->getCost(&fixedCost, &sampleCost);
+        fprintf(fp, "  Adaptive length:   mode %d, %.0f Hz, cost %.3f ms + %.3f us per sample\n",
+                adaptMode, adaptRate, fixedCost * 1e3, sampleCost * 1e6);
         fprintf(fp, "  Data type:         %d\n", dataType);
+        char schedStatus[bufferSize];
+        double readerLatency, workerLatency, workerLatencyMax;
+        getStringParam(DtacqSchedStatus, sizeof(schedStatus), schedStatus);
+        getDoubleParam(DtacqReaderLatency, &readerLatency);
+        getDoubleParam(DtacqWorkerLatency, &workerLatency);
+        getDoubleParam(DtacqWorkerLatencyMax, &workerLatencyMax);
+        fprintf(fp, "  Scheduling:        %s (worker failures %d)\n", schedStatus,
+                workerPool->scheduleFailures());
+        rawArena->report(fp);
+        fprintf(fp, "  Reader faults:     %ld minor, %ld major since acquisition started%s\n",
+                readerMinorFaults, readerMajorFaults,
+                (pArenaArray && pArenaArray->getReferenceCount() > 1 && pRaw != pArenaArray) ?
+                " (arena frame held by a plugin)" : "");
+        fprintf(fp, "  Latency:           reader %.1f us, workers %.1f us mean, %.1f us max\n",
+                readerLatency, workerLatency, workerLatencyMax);
+        int policy, droppedFrames, rawFrames;
+        getIntegerParam(DtacqOverflowPolicy, &policy);
+        getIntegerParam(DtacqDroppedFrames, &droppedFrames);
+        getIntegerParam(DtacqRawFrames, &rawFrames);
+        fprintf(fp, "  Overflow policy:   %d\n", policy);
+        fprintf(fp, "  Dropped frames:    %d (%llu bytes, %llu samples)\n", droppedFrames,
+                (unsigned long long)droppedBytes, (unsigned long long)droppedSamples);
+        fprintf(fp, "  Raw-only frames:   %d\n", rawFrames);
+        int calSource, calChannels;
+        getIntegerParam(DtacqCalSource, &calSource);
+        getIntegerParam(DtacqCalChannels, &calChannels);
+        fprintf(fp, "  Calibration:       source %d, %d channels calibrated, %d ranges cached\n",
+                calSource, calChannels, (int)calibrationCache.size());
+        for (size_t s = 0; s < sites.size(); s++)
+            fprintf(fp, "  Site %d:            module %d, channels %d-%d\n", sites[s].site,
+                    sites[s].moduleType, sites[s].firstColumn + 1, sites[s].firstColumn + sites[s].nChannels);
+        if (commandQueue) commandQueue->report(fp);
+        shmWriter->report(fp);
+        if (details > 1) {
+            for (size_t c = 0; c < channelScale.size(); c++)
+                fprintf(fp, "    ch%02d: %.9g V/count %+.6g V\n", (int)c + 1, channelScale[c], channelOffset[c]);
+        }
     }
     /* Invoke the base class method */
     ADDriver::report(fp, details);
@@ -936,13 +2592,29 @@ void dtacq_adc::report(FILE *fp, int details)
 dtacq_adc* adc = NULL;
 extern "C" int dtacq_adcConfig(const char *portName, const char *dataPortName, const char *controlPortName,
                                int nChannels, int moduleType, int nSamples, int maxBuffers, int maxMemory,
-                               const char *dataHostInfo, int priority, int stackSize)
+                               const char *dataHostInfo, int priority, int stackSize,
+                               int readerPriority, const char *readerCpus,
+                               int workerPriority, const char *workerCpus)
 {
     if (adc != NULL) delete adc;
     adc = new dtacq_adc(portName, dataPortName, controlPortName, nChannels, moduleType, nSamples,
                   (maxBuffers < 0) ? 0 : maxBuffers,
                   (maxMemory < 0) ? 0 : maxMemory, dataHostInfo,
                   priority, stackSize);
+    if (readerPriority > 0 || workerPriority > 0 || (readerCpus && *readerCpus) || (workerCpus && *workerCpus))
+        adc->setScheduling(readerPriority, readerCpus, workerPriority, workerCpus);
+    return(asynSuccess);
+}
+
+/* Change the real-time scheduling of the acquisition threads after dtacq_adcConfig */
+extern "C" int dtacq_adcSetScheduling(int readerPriority, const char *readerCpus,
+                                      int workerPriority, const char *workerCpus)
+{
+    if (adc == NULL) {
+        printf("dtacq_adcSetScheduling: dtacq_adcConfig has not been called\n");
+        return(asynError);
+    }
+    adc->setScheduling(readerPriority, readerCpus, workerPriority, workerCpus);
     return(asynSuccess);
 }
 /* Code for iocsh registration */
@@ -959,6 +2631,10 @@ static const iocshArg dtacq_adcConfigArg7 = {"maxMemory", iocshArgInt};
 static const iocshArg dtacq_adcConfigArg8 = {"dataHostInfo", iocshArgString};
 static const iocshArg dtacq_adcConfigArg9 = {"priority", iocshArgInt};
 static const iocshArg dtacq_adcConfigArg10 = {"stackSize", iocshArgInt};
+static const iocshArg dtacq_adcConfigArg11 = {"readerPriority (SCHED_FIFO)", iocshArgInt};
+static const iocshArg dtacq_adcConfigArg12 = {"readerCpus", iocshArgString};
+static const iocshArg dtacq_adcConfigArg13 = {"workerPriority (SCHED_FIFO)", iocshArgInt};
+static const iocshArg dtacq_adcConfigArg14 = {"workerCpus", iocshArgString};
 
 static const iocshArg * const dtacq_adcConfigArgs[] =  {&dtacq_adcConfigArg0,
                                                         &dtacq_adcConfigArg1,
@@ -970,14 +2646,34 @@ static const iocshArg * const dtacq_adcConfigArgs[] =  {&dtacq_adcConfigArg0,
                                                         &dtacq_adcConfigArg7,
                                                         &dtacq_adcConfigArg8,
                                                         &dtacq_adcConfigArg9,
-                                                        &dtacq_adcConfigArg10};
-static const iocshFuncDef configdtacq_adc = {"dtacq_adcConfig", 11,
+                                                        &dtacq_adcConfigArg10,
+                                                        &dtacq_adcConfigArg11,
+                                                        &dtacq_adcConfigArg12,
+                                                        &dtacq_adcConfigArg13,
+                                                        &dtacq_adcConfigArg14};
+static const iocshFuncDef configdtacq_adc = {"dtacq_adcConfig", 15,
                                              dtacq_adcConfigArgs};
 static void configdtacq_adcCallFunc(const iocshArgBuf *args)
 {
     dtacq_adcConfig(args[0].sval, args[1].sval, args[2].sval, args[3].ival,
                     args[4].ival, args[5].ival, args[6].ival, args[7].ival,
-                    args[8].sval, args[9].ival, args[10].ival);
+                    args[8].sval, args[9].ival, args[10].ival,
+                    args[11].ival, args[12].sval, args[13].ival, args[14].sval);
+}
+
+static const iocshArg dtacq_adcSetSchedulingArg0 = {"readerPriority (SCHED_FIFO)", iocshArgInt};
+static const iocshArg dtacq_adcSetSchedulingArg1 = {"readerCpus", iocshArgString};
+static const iocshArg dtacq_adcSetSchedulingArg2 = {"workerPriority (SCHED_FIFO)", iocshArgInt};
+static const iocshArg dtacq_adcSetSchedulingArg3 = {"workerCpus", iocshArgString};
+static const iocshArg * const dtacq_adcSetSchedulingArgs[] = {&dtacq_adcSetSchedulingArg0,
+                                                              &dtacq_adcSetSchedulingArg1,
+                                                              &dtacq_adcSetSchedulingArg2,
+                                                              &dtacq_adcSetSchedulingArg3};
+static const iocshFuncDef setschedulingdtacq_adc = {"dtacq_adcSetScheduling", 4,
+                                                    dtacq_adcSetSchedulingArgs};
+static void setschedulingdtacq_adcCallFunc(const iocshArgBuf *args)
+{
+    dtacq_adcSetScheduling(args[0].ival, args[1].sval, args[2].ival, args[3].sval);
 }
 
 /* Post-init configuration command for gain settings */
@@ -1012,6 +2708,7 @@ static void dtacq_adcRegister(void)
 {
     iocshRegister(&configdtacq_adc, configdtacq_adcCallFunc);
     iocshRegister(&postinitconfigdtacq_adc, postinitconfigdtacq_adcCallFunc);
+    iocshRegister(&setschedulingdtacq_adc, setschedulingdtacq_adcCallFunc);
 }
 
 extern "C" {
@@ -1,6 +1,19 @@
 #include "ADDriver.h"
+#include "dtacqCompress.h"
+#include "dtacqRealtime.h"
+#include "dtacqCommandQueue.h"
+#include "dtacqKernels.h"
+
+class dtacqWorkerPool;
+class dtacqArena;
+class dtacqSampleRing;
+class dtacqSpectrum;
+class dtacqShmWriter;
+class dtacqFrameSizer;
 
 const size_t bufferSize = 128;
+/* Per-channel lists (e.g. calibration) need more room than single values */
+const size_t calBufferSize = 4096;
 #define STRINGLEN 128
 
 
@@ -11,6 +24,109 @@ const size_t bufferSize = 128;
 #define DtacqChannelsString          "CHANNELS"
 #define DtacqEnableScratchpadString  "USE_SAMPLE_COUNT"
 #define DtacqBadFramesString         "BAD_ARRAY"
+#define DtacqOverflowPolicyString    "OVERFLOW_POLICY"
+#define DtacqDroppedFramesString     "DROPPED_FRAMES"
+#define DtacqDroppedBytesString      "DROPPED_BYTES"
+#define DtacqDroppedSamplesString    "DROPPED_SAMPLES"
+#define DtacqRawFramesString         "RAW_FRAMES"
+#define DtacqChunkSamplesString      "CHUNK_SAMPLES"
+#define DtacqChunkAssembleString     "CHUNK_ASSEMBLE"
+#define DtacqCalSourceString         "CAL_SOURCE"
+#define DtacqCalFileString           "CAL_FILE"
+#define DtacqCalChannelsString       "CAL_CHANNELS"
+#define DtacqInvertMaskString        "INVERT_MASK"
+#define DtacqReplayModeString        "REPLAY_MODE"
+#define DtacqReplayFileString        "REPLAY_FILE"
+#define DtacqReplayRateString        "REPLAY_RATE"
+#define DtacqReplayLoopString        "REPLAY_LOOP"
+#define DtacqCompressString          "COMPRESS"
+#define DtacqCompressVerifyString    "COMPRESS_VERIFY"
+#define DtacqCompressRatioString     "COMPRESS_RATIO"
+#define DtacqCompressErrorsString    "COMPRESS_ERRORS"
+#define DtacqAlignCheckString        "ALIGN_CHECK"
+#define DtacqMisalignedString        "MISALIGNED"
+#define DtacqAlignSlipString         "ALIGN_SLIP"
+#define DtacqDemuxSitesString        "DEMUX_SITES"
+#define DtacqSiteNumberString        "SITE_NUMBER"
+#define DtacqSiteModuleString        "SITE_MODULE"
+#define DtacqSiteChannelsString      "SITE_CHANNELS"
+#define DtacqSchedStatusString       "SCHED_STATUS"
+#define DtacqReaderLatencyString     "READER_LATENCY"
+#define DtacqWorkerLatencyString     "WORKER_LATENCY"
+#define DtacqWorkerLatencyMaxString  "WORKER_LATENCY_MAX"
+#define DtacqActualSampleRateString  "ACTUAL_SAMPLE_RATE"
+#define DtacqSocketBacklogString     "SOCKET_BACKLOG"
+#define DtacqBacklogFillString       "BACKLOG_FILL"
+#define DtacqConsumedRateString      "CONSUMED_RATE"
+#define DtacqExpectedRateString      "EXPECTED_RATE"
+#define DtacqHeadroomString          "HEADROOM"
+#define DtacqOverrunTimeString       "OVERRUN_TIME"
+#define DtacqOverrunWarnTimeString   "OVERRUN_WARN_TIME"
+#define DtacqOverrunPredictedString  "OVERRUN_PREDICTED"
+#define DtacqWindowLengthString      "WINDOW_LENGTH"
+#define DtacqWindowHopString         "WINDOW_HOP"
+#define DtacqWindowCountString       "WINDOW_COUNT"
+#define DtacqWindowDroppedString     "WINDOW_DROPPED"
+#define DtacqFftSizeString           "FFT_SIZE"
+#define DtacqFftAveragesString       "FFT_AVERAGES"
+#define DtacqFftChannelString        "FFT_CHANNEL"
+#define DtacqFftCountString          "FFT_COUNT"
+#define DtacqFftFreqStepString       "FFT_FREQ_STEP"
+#define DtacqFftFreqString           "FFT_FREQ"
+#define DtacqFftPsdString            "FFT_PSD"
+#define DtacqCmdPendingString        "CMD_PENDING"
+#define DtacqCmdCountString          "CMD_COUNT"
+#define DtacqCmdCoalescedString      "CMD_COALESCED"
+#define DtacqCmdErrorsString         "CMD_ERRORS"
+#define DtacqCmdLatencyString        "CMD_LATENCY"
+#define DtacqCmdLatencyMeanString    "CMD_LATENCY_MEAN"
+#define DtacqCmdLatencyMaxString     "CMD_LATENCY_MAX"
+#define DtacqCmdResetString          "CMD_RESET"
+#define DtacqSpadWordsString         "SPAD_WORDS"
+#define DtacqSpadDixString           "SPAD_DIX"
+#define DtacqShmNameString           "SHM_NAME"
+#define DtacqShmSlotsString          "SHM_SLOTS"
+#define DtacqShmSlotMBString         "SHM_SLOT_MB"
+#define DtacqShmSourceString         "SHM_SOURCE"
+#define DtacqShmFramesString         "SHM_FRAMES"
+#define DtacqShmDroppedString        "SHM_DROPPED"
+#define DtacqShmStatusString         "SHM_STATUS"
+#define DtacqAdaptModeString         "ADAPT_MODE"
+#define DtacqAdaptTargetString       "ADAPT_TARGET"
+#define DtacqAdaptMinString          "ADAPT_MIN"
+#define DtacqAdaptMaxString          "ADAPT_MAX"
+#define DtacqAdaptSamplesString      "ADAPT_SAMPLES"
+#define DtacqAdaptRateString         "ADAPT_RATE"
+#define DtacqPipelineTimeString      "PIPELINE_TIME"
+
+/* NDArray addresses published by the driver */
+#define DTACQ_FRAME_ADDR 0   /* Complete frames */
+#define DTACQ_CHUNK_ADDR 1   /* Sub-frames published as they arrive when CHUNK_SAMPLES > 0 */
+#define DTACQ_COMPRESSED_ADDR 2  /* Losslessly compressed raw frames when COMPRESS is on */
+#define DTACQ_SITE_ADDR  3   /* First of DTACQ_MAX_SITES per-site frames when DEMUX_SITES is on */
+#define DTACQ_MAX_SITES  6
+#define DTACQ_WINDOW_ADDR (DTACQ_SITE_ADDR + DTACQ_MAX_SITES)  /* Overlapping windows when WINDOW_LENGTH > 0 */
+#define DTACQ_FFT_ADDR   (DTACQ_WINDOW_ADDR + 1)  /* Averaged power spectra when FFT_SIZE > 0 */
+#define DTACQ_NUM_ADDR   (DTACQ_FFT_ADDR + 1)
+
+/* Sliding windows: NDArrays that may be out with plugins at once, and ring size in windows */
+#define DTACQ_WINDOW_SHELLS 16
+#define DTACQ_WINDOW_RING   8
+
+/* Rows converted per site before moving on to the next site when demultiplexing */
+#define DTACQ_DEMUX_ROWS 64
+
+/* Number of worker threads (in addition to the acquisition thread) for per-frame processing */
+#define DTACQ_NUM_WORKERS 3
+
+/* Sleeps used to measure the reader's wake-up latency when acquisition starts */
+#define DTACQ_LATENCY_PROBES   10
+#define DTACQ_LATENCY_INTERVAL 0.0005
+
+/* Seconds between samples of the data socket's receive queue, and the fill level of
+   the receive buffer that raises OVERRUN_PREDICTED regardless of the trend */
+#define DTACQ_BACKLOG_INTERVAL 0.5
+#define DTACQ_BACKLOG_FULL     0.9
 
 typedef enum DtacqModuleType {
   ACQ420=1,
@@ -18,6 +134,66 @@ typedef enum DtacqModuleType {
   ACQ437=6
 } DtacqModuleType;
 
+/* What to do when the NDArrayPool cannot supply a buffer for the next frame */
+typedef enum DtacqOverflowPolicy {
+  DtacqDropNewest=0,   /* Drain the frame from the socket and discard it */
+  DtacqDropOldest=1,   /* Give back the last published frame and retry, else drop newest */
+  DtacqRawOnly=2       /* Publish the raw frame if the Float64 conversion cannot be allocated */
+} DtacqOverflowPolicy;
+
+/* Where the per-channel calibration comes from */
+typedef enum DtacqCalSourceType {
+  DtacqCalNone=0,      /* Nominal scaling from the ranges table only */
+  DtacqCalCarrier=1,   /* AI:CAL:ESLO / AI:CAL:EOFF read over the control port */
+  DtacqCalFile=2       /* Local file, see CAL_FILE */
+} DtacqCalSourceType;
+
+/* Data source: the carrier's data port, or a recorded capture of it */
+typedef enum DtacqReplayModeType {
+  DtacqReplayOff=0,    /* Live data from the data port */
+  DtacqReplayFast=1,   /* Replay REPLAY_FILE as fast as it can be processed */
+  DtacqReplayPaced=2   /* Replay REPLAY_FILE at REPLAY_RATE samples per second */
+} DtacqReplayModeType;
+
+/* Which frame is copied into the shared memory ring */
+typedef enum DtacqShmSourceType {
+  DtacqShmConverted=0, /* The published frame, as plugins receive it */
+  DtacqShmRaw=1        /* The raw frame as read from the data port */
+} DtacqShmSourceType;
+
+/* One module in the aggregated stream, in AGGR_SITES order */
+typedef struct DtacqSite {
+  int site;          /* Site number on the carrier */
+  int moduleType;    /* As reported by the module, see DtacqModuleType */
+  int nChannels;
+  int firstColumn;   /* Column of the site's first channel in the raw frame */
+} DtacqSite;
+
+/* Site information as read from the carrier, before it is applied to the driver */
+typedef struct DtacqSiteInfo {
+  int moduleType;              /* Of the master site */
+  std::string manufacturer;    /* Of the master site */
+  std::vector<DtacqSite> sites;
+} DtacqSiteInfo;
+
+/* Identifies what to do when a control port command queued by the driver completes */
+typedef enum DtacqCommandTag {
+  DtacqCmdPlain=0,     /* Nothing beyond reporting a failure */
+  DtacqCmdDataType,    /* Readback of data32; arg is the requested NDDataType */
+  DtacqCmdScratchpad,  /* Readback of spad; arg is the requested enable */
+  DtacqCmdCalSlope,    /* AI:CAL:ESLO for range arg */
+  DtacqCmdCalOffset,   /* AI:CAL:EOFF for range arg; completes the calibration */
+  DtacqCmdSites,       /* Re-read the site information */
+  DtacqCmdStart,       /* Read the site information and arm the carrier; arg is the acquisition */
+  DtacqCmdArm          /* run0 sent; connect the data port and start acquiring; arg as for Start */
+} DtacqCommandTag;
+
+/* Per-channel calibration for one range: slope in volts per ADC code, offset in volts */
+typedef struct DtacqCalibration {
+  std::vector<double> eslo;
+  std::vector<double> eoff;
+} DtacqCalibration;
+
 static const char *driverName = "dtacq_adc";
 class dtacq_adc : public ADDriver {
 public:
@@ -29,8 +205,11 @@ public:
     virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
     virtual void report(FILE *fp, int details);
     void dtacqTask();
+    void compressBlock(int block, int worker);
+    void spectrumPair(int pair, int worker);
+    void commandDone(const DtacqCommand *command);
+    void setScheduling(int readerPriority, const char *readerCpus, int workerPriority, const char *workerCpus);
     /* Parameters specific to dtacq_adc (areaDetector) */
-    // ###TODO: Inversion is not currently implemented
     int DtacqAdcInvert;
 #define DTACQ_FIRST_PARAMETER DtacqAdcInvert
     int DtacqAggregationSites;
@@ -39,23 +218,125 @@ public:
     int DtacqChannels;
     int DtacqEnableScratchpad;
     int DtacqBadFrames;
+    int DtacqOverflowPolicy;
+    int DtacqDroppedFrames;
+    int DtacqDroppedBytes;
+    int DtacqDroppedSamples;
+    int DtacqRawFrames;
+    int DtacqChunkSamples;
+    int DtacqChunkAssemble;
+    int DtacqCalSource;
+    int DtacqCalFile;
+    int DtacqCalChannels;
+    int DtacqInvertMask;
+    int DtacqReplayMode;
+    int DtacqReplayFile;
+    int DtacqReplayRate;
+    int DtacqReplayLoop;
+    int DtacqCompress;
+    int DtacqCompressVerify;
+    int DtacqCompressRatio;
+    int DtacqCompressErrors;
+    int DtacqAlignCheck;
+    int DtacqMisaligned;
+    int DtacqAlignSlip;
+    int DtacqDemuxSites;
+    int DtacqSiteNumber;
+    int DtacqSiteModule;
+    int DtacqSiteChannels;
+    int DtacqSchedStatus;
+    int DtacqReaderLatency;
+    int DtacqWorkerLatency;
+    int DtacqWorkerLatencyMax;
+    int DtacqActualSampleRate;
+    int DtacqSocketBacklog;
+    int DtacqBacklogFill;
+    int DtacqConsumedRate;
+    int DtacqExpectedRate;
+    int DtacqHeadroom;
+    int DtacqOverrunTime;
+    int DtacqOverrunWarnTime;
+    int DtacqOverrunPredicted;
+    int DtacqWindowLength;
+    int DtacqWindowHop;
+    int DtacqWindowCount;
+    int DtacqWindowDropped;
+    int DtacqFftSize;
+    int DtacqFftAverages;
+    int DtacqFftChannel;
+    int DtacqFftCount;
+    int DtacqFftFreqStep;
+    int DtacqFftFreq;
+    int DtacqFftPsd;
+    int DtacqCmdPending;
+    int DtacqCmdCount;
+    int DtacqCmdCoalesced;
+    int DtacqCmdErrors;
+    int DtacqCmdLatency;
+    int DtacqCmdLatencyMean;
+    int DtacqCmdLatencyMax;
+    int DtacqCmdReset;
+    int DtacqSpadWords;
+    int DtacqSpadDix;
+    int DtacqShmName;
+    int DtacqShmSlots;
+    int DtacqShmSlotMB;
+    int DtacqShmSource;
+    int DtacqShmFrames;
+    int DtacqShmDropped;
+    int DtacqShmStatus;
+    int DtacqAdaptMode;
+    int DtacqAdaptTarget;
+    int DtacqAdaptMin;
+    int DtacqAdaptMax;
+    int DtacqAdaptSamples;
+    int DtacqAdaptRate;
+    int DtacqPipelineTime;
+#define DTACQ_LAST_PARAMETER DtacqPipelineTime
     //
-#define DTACQ_NUM_PARAMETERS ((int) (&DtacqBadFrames - &DTACQ_FIRST_PARAMETER + 1))
+#define DTACQ_NUM_PARAMETERS ((int) (&DTACQ_LAST_PARAMETER - &DTACQ_FIRST_PARAMETER + 1))
 
 private:
     /* Frame handling functions */
-    int readArray(int n_samples, int n_channels, int nBytes);
+    int readArray(char *pData, int n_samples, int n_channels, int nBytes);
+    int readReplay(char *pData, int n_samples, size_t nBytes);
+    asynStatus openReplay();
+    int discardFrame(int n_samples, int n_channels, int nBytes);
+    void countDroppedFrame(int n_samples, size_t nBytes);
+    int readChunked(int n_samples, int n_channels, int nBytes, int chunkSamples, int skipCount,
+                    int firstChannel, int nOut);
+    void publishChunk(const char *pData, int n_samples, int n_channels, int nBytes, int skipCount,
+                      int firstChannel, int nOut, int sampleOffset, int chunkIndex);
     int computeImage();
+    bool idsCountUp(const epicsInt32 *pRow, int rowWidth, int nData, int slip);
+    asynStatus checkAlignment(const epicsInt32 *pData, int nRows, int rowWidth, int nData);
+    void publishCompressed(int uniqueId, epicsTimeStamp timeStamp, int arrayCallbacks);
+    void publishSites(int uniqueId, epicsTimeStamp timeStamp, int arrayCallbacks);
+    void publishWindows(NDArray *pFrame, epicsTimeStamp timeStamp, int arrayCallbacks);
+    void publishSpectrum(NDArray *pFrame, epicsTimeStamp timeStamp, int arrayCallbacks);
+    void publishShm(NDArray *pFrame, epicsTimeStamp timeStamp);
+    void adaptFrameLength();
     /* Connection handling and device communication functions */
-    asynStatus getSiteInformation();
-    asynStatus getDeviceParameter(const char *parameter, char *readBuffer,
-                                  int bufferLen, const char *site=NULL);
-    asynStatus setDeviceParameter(const char *parameter, const char *value, const char *site=NULL);
+    void readSiteInformation(int master, const char *siteList, DtacqSiteInfo *info);
+    asynStatus applySiteInformation(const DtacqSiteInfo *info);
+    asynStatus requestDeviceParameter(const char *parameter, int tag, int arg, const char *site=NULL);
+    asynStatus setDeviceParameter(const char *parameter, const char *value, const char *site=NULL,
+                                  int tag=DtacqCmdPlain, int arg=0);
+    void updateCommandStats();
     void closeSocket();
+    void applyReaderSchedule();
+    void resetBacklog();
+    void updateBacklog();
     /* Data processing functions */
     asynStatus calculateConversionFactor(int gainSelection, double *factor);
+    asynStatus moduleConversionFactor(int module, int gainSelection, double *factor);
     asynStatus calculateDataSize();
-    asynStatus applyScaling(NDArray *pFrame, int nChannels, int skipElements);
+    void getFrameLayout(int wordBytes, DtacqFrameLayout *layout);
+    void addSpadAttributes(NDArray *pFrame);
+    asynStatus applyScaling(NDArray *pIn, NDArray *pOut, int firstChannel, int skipElements);
+    asynStatus loadCalibration(int source, int gainSelection, DtacqCalibration *cal);
+    void requestCarrierCalibration(int gainSelection);
+    void updateCalibration();
     asynStatus applyBitMask(NDArray *pFrame, int nChannels, int skipElements);
     int nElements(NDArray *pFrame);
     /* Events */
@@ -63,14 +344,94 @@ private:
     epicsEvent *acquireStopEvent;
     /* Raw frame (read from device data port) */
     NDArray *pRaw;
+    /* Locked, prefaulted memory for the raw frame, wrapped in an NDArray that is never
+       returned to the pool; used whenever no plugin still holds the previous raw frame */
+    dtacqArena *rawArena;
+    NDArray *pArenaArray;
+    /* Page faults taken by the acquisition thread since acquisition started */
+    long faultBaseMinor, faultBaseMajor;
+    long readerMinorFaults, readerMajorFaults;
+    /* Scratch space used to drain frames from the socket when no NDArray is available */
+    std::vector<char> discardBuffer;
+    /* Overflow accounting (kept here as 64 bit, published as doubles) */
+    uint64_t droppedBytes;
+    uint64_t droppedSamples;
+    /* Chunked publishing */
+    int chunkCounter;
+    bool publishFrame;
     /* Device communication parameters*/
     char dataPortName[STRINGLEN], dataHostInfo[STRINGLEN];
     asynUser *commonDataIPPort, *octetDataIPPort;
     asynUser *controlIPPort;
+    /* Receive queue monitoring of the data connection */
+    int dataSocket;
+    uint64_t bytesConsumed;
+    uint64_t backlogBytes;
+    long lastQueued;
+    epicsTimeStamp backlogTime;
+    epicsTimeStamp readSampleTime;   /* Only used by the acquisition thread, in readArray() */
+    /* Replay of a recorded data port capture; settings are latched when acquisition starts */
+    int replayMode;
+    FILE *replayFile;
+    epicsMutex replayMutex;
+    bool replayEnded;
+    int replayLoop;
+    double replayRate;
+    double replaySamples;
+    epicsTimeStamp replayStart;
     /* Gain control parameters and value scaling */
     std::map<int, std::vector<double> > ranges;
     int moduleType;
     double count2volt;
+    /* Modules making up the aggregated stream, read from the carrier when acquisition starts */
+    std::vector<DtacqSite> sites;
+    /* Sliding windows over the published frames */
+    dtacqSampleRing *windowRing;
+    int windowCounter;
+    /* Welch averaged spectra, accumulated on the worker pool */
+    dtacqSpectrum *spectrum;
+    int spectrumFrames;
+    /* Set when acquisition starts; the partial average is discarded by dtacqTask between frames */
+    bool spectrumReset;
+    int spectrumCounter;
+    const double *spectrumFrame;
+    int spectrumRows, spectrumWidth;
+    std::vector<std::vector<double> > spectrumScratch;
+    std::vector<double> spectrumOut, spectrumFreq;
+    /* Shared memory ring for local readers; shmFailed holds a configuration that could not be created */
+    dtacqShmWriter *shmWriter;
+    std::string shmFailed;
+    /* Adaptive frame length: cost model, and when the current and previous frames finished reading */
+    dtacqFrameSizer *frameSizer;
+    epicsTimeStamp readDoneTime, lastReadDone;
+    bool lastReadValid;
+    /* Per-channel calibration, cached per range selection */
+    std::map<int, DtacqCalibration> calibrationCache;
+    /* Carrier calibration being read through the command queue, per range selection */
+    std::map<int, DtacqCalibration> calibrationPending;
+    /* Control port commands are sent from the queue's thread, so writes return at once */
+    dtacqCommandQueue *commandQueue;
+    /* Incremented by every start, so a start or arm queued for an earlier one is ignored */
+    int acquireGeneration;
+    std::vector<double> channelScale, channelOffset;
+    /* Copy of the tables taken at the start of each frame, used outside the lock */
+    std::vector<double> frameScale, frameOffset;
+    /* Row layout of the current frame, and the number of scratchpad columns at the end of each row */
+    DtacqFrameLayout frameLayout;
+    int frameSkip;
+    /* Worker threads and per-worker scratch space */
+    dtacqWorkerPool *workerPool;
+    std::vector<std::vector<uint8_t> > workerScratch;
+    /* Real-time scheduling of the acquisition thread, applied when acquisition starts */
+    DtacqSchedule readerSchedule;
+    int readerScheduleGeneration;
+    int readerScheduleApplied;
+    /* Compression of the raw frame */
+    DtacqCodecFrame compressFrame;
+    size_t compressBound;
+    std::vector<uint8_t> compressSlots;
+    std::vector<uint32_t> compressSizes;
+    std::vector<char> verifyBuffer;
     /* Mask to zero out the site/channel information in 24bit data */
     static const int bitMask = 0xffffff00;
     /* Override values for ACQ420FMC gain options */
@@ -79,6 +440,11 @@ private:
     int gvals[ngvals];
     int gseverities[ngvals];
     bool cleanSampleSeen;
+    /* Site/channel ID byte expected in each data column (32 bit mode), and whether it
+       varies enough between columns to detect a slip */
+    std::vector<epicsInt32> idSignature;
+    bool idCheckUsable;
+    int realignWords;
     // 64 bit so that ADC will overflow before we do (since it stores this as a 32 bit int)
     uint64_t sampleCount;
 };
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include <epicsTime.h>
+
+#include "dtacqTestFrames.h"
+
+/* Micro-benchmark of the frame processing kernels on synthetic frames.
+
+   Usage: benchDtacqKernels [rows] [seconds]
+   Each kernel is run over a frame of rows samples until seconds have passed, and the time
+   per sample (one row of every channel) and per value is printed. Compare runs before and
+   after changing a kernel; testDtacqKernels checks that the results have not changed. */
+
+static const int channelCounts[] = {8, 32, 96};
+static const int spadSizes[] = {0, 1, 4};
+#define NELEMENTS(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+typedef void (*benchFunc)(void *arg);
+
+/* Seconds per call of func, repeated until minSeconds have passed */
+static double timeCalls(benchFunc func, void *arg, double minSeconds)
+{
+    epicsTimeStamp start, now;
+    long calls = 0;
+    double elapsed;
+    func(arg);
+    epicsTimeGetCurrent(&start);
+    do {
+        func(arg);
+        calls++;
+        epicsTimeGetCurrent(&now);
+        elapsed = epicsTimeDiffInSeconds(&now, &start);
+    } while (elapsed < minSeconds);
+    return elapsed / calls;
+}
+
+typedef struct benchFrame {
+    DtacqTestFrame frame;
+    std::vector<double> out;
+    std::vector<epicsUInt8> work;
+    std::vector<epicsInt32> signature;
+    std::vector<uint8_t> compressed, scratch;
+    DtacqCodecFrame codec;
+} benchFrame;
+
+template <typename epicsType>
+static void convertSelected(void *arg)
+{
+    benchFrame *b = (benchFrame *)arg;
+    const DtacqTestFrame *f = &b->frame;
+    epicsType mask = (sizeof(epicsType) == 2) ? (epicsType)~0 : (epicsType)DTACQ_TEST_MASK32;
+    dtacqToVolts<epicsType>::select(dtacqSpadColumns(&f->layout))(
+        (const epicsType *)&f->raw[0], &b->out[0], f->nRows, f->rowWidth, f->rowWidth,
+        f->layout.nChannels, mask, &f->scale[0], &f->offset[0]);
+}
+
+template <typename epicsType>
+static void convertGeneric(void *arg)
+{
+    benchFrame *b = (benchFrame *)arg;
+    const DtacqTestFrame *f = &b->frame;
+    epicsType mask = (sizeof(epicsType) == 2) ? (epicsType)~0 : (epicsType)DTACQ_TEST_MASK32;
+    dtacqRawToVolts<epicsType>((const epicsType *)&f->raw[0], &b->out[0], f->nRows, f->rowWidth, f->rowWidth,
+                               f->layout.nChannels, mask, &f->scale[0], &f->offset[0]);
+}
+
+static void maskData(void *arg)
+{
+    benchFrame *b = (benchFrame *)arg;
+    const DtacqTestFrame *f = &b->frame;
+    dtacqMaskData((epicsInt32 *)&b->work[0], f->nRows, f->rowWidth, f->layout.nChannels, DTACQ_TEST_MASK32);
+}
+
+static void checkCounts(void *arg)
+{
+    benchFrame *b = (benchFrame *)arg;
+    const DtacqTestFrame *f = &b->frame;
+    uint64_t next = 0, badExpected;
+    uint32_t badValue;
+    bool valid = false;
+    dtacqCheckSampleCounts(&f->raw[0], f->nRows, (size_t)f->rowWidth * f->layout.wordBytes,
+                           dtacqSpadOffset(&f->layout, 0), &next, &valid, &badExpected, &badValue);
+}
+
+static void findIdMismatch(void *arg)
+{
+    benchFrame *b = (benchFrame *)arg;
+    const DtacqTestFrame *f = &b->frame;
+    dtacqFindIdMismatch((const epicsInt32 *)&f->raw[0], f->nRows, f->rowWidth, f->layout.nChannels,
+                        &b->signature[0]);
+}
+
+static void compress(void *arg)
+{
+    benchFrame *b = (benchFrame *)arg;
+    dtacqTestCompress(&b->codec, &b->compressed, &b->scratch);
+}
+
+static void decompress(void *arg)
+{
+    benchFrame *b = (benchFrame *)arg;
+    dtacqDecompress(&b->compressed[0], b->compressed.size(), &b->work[0], b->work.size());
+}
+
+static void report(const char *kernel, const benchFrame *b, double seconds)
+{
+    const DtacqTestFrame *f = &b->frame;
+    printf("  %-22s %10.2f ns/sample %8.3f ns/value\n", kernel, seconds * 1e9 / f->nRows,
+           seconds * 1e9 / ((double)f->nRows * f->rowWidth));
+}
+
+int main(int argc, char **argv)
+{
+    int nRows = (argc > 1) ? atoi(argv[1]) : 100000;
+    double seconds = (argc > 2) ? atof(argv[2]) : 0.5;
+    if (nRows < 1) nRows = 1;
+    printf("%d samples per frame, %.2f s per kernel\n", nRows, seconds);
+    for (int wordBytes = 2; wordBytes <= 4; wordBytes += 2) {
+        for (int c = 0; c < NELEMENTS(channelCounts); c++) {
+            for (int s = 0; s < NELEMENTS(spadSizes); s++) {
+                benchFrame b;
+                DtacqTestFrame *f = &b.frame;
+                int nChannels = channelCounts[c];
+                dtacqTestMakeFrame(f, wordBytes, nChannels, spadSizes[s], 0, nRows, 1u);
+                b.out.resize((size_t)nRows * f->rowWidth);
+                b.work = f->raw;
+                b.codec.pData = &f->raw[0];
+                b.codec.elemSize = wordBytes;
+                b.codec.rowWidth = f->rowWidth;
+                b.codec.nRows = nRows;
+                b.codec.nData = nChannels;
+                b.codec.dataShift = (wordBytes == 4) ? DTACQ_TEST_SHIFT32 : 0;
+                printf("%d bit, %d channels, %d spad words:\n", wordBytes * 8, nChannels, spadSizes[s]);
+                if (wordBytes == 2) {
+                    report("convert (specialised)", &b, timeCalls(convertSelected<epicsInt16>, &b, seconds));
+                    report("convert (generic)", &b, timeCalls(convertGeneric<epicsInt16>, &b, seconds));
+                } else {
+                    report("convert (specialised)", &b, timeCalls(convertSelected<epicsInt32>, &b, seconds));
+                    report("convert (generic)", &b, timeCalls(convertGeneric<epicsInt32>, &b, seconds));
+                    report("mask ID bytes", &b, timeCalls(maskData, &b, seconds));
+                    b.signature.resize(nChannels);
+                    for (int i = 0; i < nChannels; i++) b.signature[i] = dtacqTestId(i);
+                    report("check alignment", &b, timeCalls(findIdMismatch, &b, seconds));
+                }
+                if (dtacqHasSampleCounter(&f->layout))
+                    report("check sample counter", &b, timeCalls(checkCounts, &b, seconds));
+                report("compress", &b, timeCalls(compress, &b, seconds));
+                report("decompress", &b, timeCalls(decompress, &b, seconds));
+                printf("  %-22s %10.2f : 1\n", "compression ratio",
+                       (double)f->raw.size() / b.compressed.size());
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,135 @@
+#ifndef DTACQTESTFRAMES_H
+#define DTACQTESTFRAMES_H
+
+#include <string.h>
+#include <vector>
+
+#include <epicsTypes.h>
+
+#include "dtacqKernels.h"
+#include "dtacqCompress.h"
+
+/* Synthetic raw frames for the kernel tests and benchmarks, and plain reference versions
+   of the conversions to check the kernels against.
+
+   Every data word is pseudo-random; in 32 bit mode its low byte is the channel's ID byte.
+   Scratchpad word 0 is a sample counter that wraps half way through the frame (unless
+   DIX has taken it), the last word carries the digital inputs when DIX is set and any
+   other words are pseudo-random. */
+
+#define DTACQ_TEST_MASK32  ((epicsInt32)0xffffff00)
+#define DTACQ_TEST_SHIFT32 8
+
+typedef struct DtacqTestFrame {
+    DtacqFrameLayout layout;
+    int nRows;
+    int rowWidth;
+    epicsUInt32 firstCount;
+    std::vector<epicsUInt8> raw;         /* nRows rows of rowWidth words */
+    std::vector<epicsUInt32> spad;       /* The scratchpad words written into each row */
+    std::vector<double> scale, offset;   /* Per channel */
+} DtacqTestFrame;
+
+static inline epicsUInt32 dtacqTestRandom(epicsUInt32 *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state;
+}
+
+static inline epicsUInt8 dtacqTestId(int channel)
+{
+    return (epicsUInt8)(0x20 + channel);
+}
+
+static inline void dtacqTestMakeFrame(DtacqTestFrame *frame, int wordBytes, int nChannels, int spadWords,
+                                      int dix, int nRows, epicsUInt32 seed)
+{
+    dtacqSetLayout(&frame->layout, wordBytes, nChannels, spadWords, dix);
+    const DtacqFrameLayout *layout = &frame->layout;
+    frame->nRows = nRows;
+    frame->rowWidth = dtacqRowWidth(layout);
+    frame->firstCount = 0xffffffffu - (epicsUInt32)(nRows / 2);
+    size_t rowBytes = (size_t)frame->rowWidth * layout->wordBytes;
+    frame->raw.assign(rowBytes * nRows, 0);
+    frame->spad.assign((size_t)nRows * layout->spadWords, 0);
+    frame->scale.resize(nChannels);
+    frame->offset.resize(nChannels);
+    for (int c = 0; c < nChannels; c++) {
+        frame->scale[c] = 2.0 * 10.0 / 16777216.0 * (1.0 + 0.001 * c);
+        frame->offset[c] = 0.0005 * c - 0.01;
+    }
+    epicsUInt32 state = seed;
+    for (int r = 0; r < nRows; r++) {
+        epicsUInt8 *pRow = &frame->raw[r * rowBytes];
+        for (int c = 0; c < nChannels; c++) {
+            epicsUInt32 value = dtacqTestRandom(&state);
+            if (layout->wordBytes == 2) {
+                epicsUInt16 word = (epicsUInt16)(value >> 16);
+                memcpy(pRow + c * 2, &word, 2);
+            } else {
+                epicsUInt32 word = (value & 0xffffff00u) | dtacqTestId(c);
+                memcpy(pRow + c * 4, &word, 4);
+            }
+        }
+        epicsUInt32 *pSpad = layout->spadWords ? &frame->spad[(size_t)r * layout->spadWords] : NULL;
+        for (int n = 0; n < layout->spadWords; n++) pSpad[n] = dtacqTestRandom(&state);
+        if (layout->spadWords && dtacqHasSampleCounter(layout)) pSpad[0] = frame->firstCount + (epicsUInt32)r;
+        if (layout->dix) pSpad[layout->spadWords - 1] = dtacqTestRandom(&state) & 0xffff;
+        for (int n = 0; n < layout->spadWords; n++)
+            memcpy(pRow + dtacqSpadOffset(layout, n), &pSpad[n], sizeof(epicsUInt32));
+    }
+}
+
+/* Word c of row r, as the raw type */
+template <typename epicsType>
+epicsType dtacqTestWord(const DtacqTestFrame *frame, int r, int c)
+{
+    epicsType word;
+    memcpy(&word, &frame->raw[((size_t)r * frame->rowWidth + c) * sizeof(epicsType)], sizeof(word));
+    return word;
+}
+
+/* The conversion the driver performs: nOut columns from firstChannel, data columns masked
+   and scaled, scratchpad columns copied through */
+template <typename epicsType>
+void dtacqTestReferenceVolts(const DtacqTestFrame *frame, int firstChannel, int nOut, epicsType mask,
+                             std::vector<double> *out)
+{
+    out->resize((size_t)frame->nRows * nOut);
+    for (int r = 0; r < frame->nRows; r++) {
+        for (int k = 0; k < nOut; k++) {
+            int c = firstChannel + k;
+            epicsType word = dtacqTestWord<epicsType>(frame, r, c);
+            double value;
+            if (c < frame->layout.nChannels)
+                value = (epicsType)(word & mask) * frame->scale[c] + frame->offset[c];
+            else
+                value = word;
+            (*out)[(size_t)r * nOut + k] = value;
+        }
+    }
+}
+
+/* Compress a frame block by block into a complete compressed frame */
+static inline void dtacqTestCompress(const DtacqCodecFrame *frame, std::vector<uint8_t> *out,
+                                     std::vector<uint8_t> *scratch)
+{
+    int nBlocks = dtacqCodecBlockCount(frame);
+    size_t bound = dtacqCodecBlockBound(frame);
+    size_t headerSize = dtacqCodecHeaderSize(nBlocks);
+    std::vector<uint8_t> blocks((size_t)nBlocks * bound);
+    std::vector<uint32_t> sizes(nBlocks);
+    for (int b = 0; b < nBlocks; b++)
+        sizes[b] = dtacqCompressBlock(frame, b, &blocks[(size_t)b * bound], scratch);
+    out->resize(headerSize + (size_t)nBlocks * bound);
+    dtacqCodecWriteHeader(frame, &sizes[0], &(*out)[0]);
+    size_t pos = headerSize;
+    for (int b = 0; b < nBlocks; b++) {
+        size_t size = sizes[b] & ~DTACQ_CODEC_STORED;
+        memcpy(&(*out)[pos], &blocks[(size_t)b * bound], size);
+        pos += size;
+    }
+    out->resize(pos);
+}
+
+#endif /* DTACQTESTFRAMES_H */
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "dtacqTestFrames.h"
+
+/* Every data type, a range of channel counts (one module up to a six site aggregate) and
+   every scratchpad size the carrier supports, with and without DIX */
+static const int wordSizes[] = {2, 4};
+static const int channelCounts[] = {1, 4, 8, 16, 32, 96};
+static const int spadSizes[] = {0, 1, 2, 4, 8};
+#define NELEMENTS(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+#define TESTS_PER_FRAME 10
+#define OTHER_TESTS     6
+
+static bool sameDoubles(const std::vector<double> &a, const std::vector<double> &b)
+{
+    return a.size() == b.size() && (a.empty() || memcmp(&a[0], &b[0], a.size() * sizeof(double)) == 0);
+}
+
+template <typename epicsType>
+static void testConversion(const DtacqTestFrame *frame, epicsType mask, const char *name)
+{
+    const DtacqFrameLayout *layout = &frame->layout;
+    const epicsType *pIn = (const epicsType *)&frame->raw[0];
+    int width = frame->rowWidth;
+    int spadColumns = dtacqSpadColumns(layout);
+    std::vector<double> expected, out((size_t)frame->nRows * width);
+
+    dtacqTestReferenceVolts<epicsType>(frame, 0, width, mask, &expected);
+    dtacqToVolts<epicsType>::select(spadColumns)(pIn, &out[0], frame->nRows, width, width,
+                                                  layout->nChannels, mask, &frame->scale[0], &frame->offset[0]);
+    testOk(sameDoubles(out, expected), "%s: specialised conversion is bit exact", name);
+
+    std::fill(out.begin(), out.end(), 0.0);
+    dtacqRawToVolts<epicsType>(pIn, &out[0], frame->nRows, width, width,
+                               layout->nChannels, mask, &frame->scale[0], &frame->offset[0]);
+    testOk(sameDoubles(out, expected), "%s: generic conversion is bit exact", name);
+
+    /* A channel subset running into the scratchpad, as with MinX/SizeX */
+    int first = layout->nChannels / 2;
+    int nOut = width - first;
+    int nData = dtacqDataColumns(width, spadColumns, first, nOut, layout->nChannels);
+    dtacqTestReferenceVolts<epicsType>(frame, first, nOut, mask, &expected);
+    std::vector<double> subset((size_t)frame->nRows * nOut);
+    dtacqToVolts<epicsType>::select(nOut - nData)(pIn + first, &subset[0], frame->nRows, width, nOut,
+                                                   nData, mask, &frame->scale[first], &frame->offset[first]);
+    testOk(nData == layout->nChannels - first && sameDoubles(subset, expected),
+           "%s: channel subset from %d is bit exact", name, first);
+}
+
+static void testFrame(int wordBytes, int nChannels, int spadWords, int dix)
+{
+    char name[80];
+    sprintf(name, "%d bit, %d channels, %d spad words%s", wordBytes * 8, nChannels, spadWords,
+            dix ? ", DIX" : "");
+    DtacqTestFrame frame;
+    int nRows = 1001 + nChannels;
+    dtacqTestMakeFrame(&frame, wordBytes, nChannels, spadWords, dix, nRows, 12345u + nChannels * 16 + spadWords);
+    const DtacqFrameLayout *layout = &frame.layout;
+    size_t rowBytes = (size_t)frame.rowWidth * wordBytes;
+
+    bool counter = spadWords > 0 && !(dix && spadWords == 1);
+    testOk(frame.rowWidth == nChannels + spadWords * 4 / wordBytes && dtacqHasSampleCounter(layout) == counter,
+           "%s: row of %d words", name, frame.rowWidth);
+
+    if (wordBytes == 2)
+        testConversion<epicsInt16>(&frame, (epicsInt16)~0, name);
+    else
+        testConversion<epicsInt32>(&frame, DTACQ_TEST_MASK32, name);
+
+    epicsUInt32 spad[DTACQ_MAX_SPAD_WORDS];
+    int row = nRows / 3;
+    dtacqReadSpad(&frame.raw[row * rowBytes], layout, spad);
+    testOk(spadWords == 0 ||
+           memcmp(spad, &frame.spad[(size_t)row * spadWords], spadWords * sizeof(epicsUInt32)) == 0,
+           "%s: scratchpad words read back", name);
+
+    if (counter) {
+        /* The counter wraps through 0xffffffff half way through the frame */
+        uint64_t next = 0, badExpected = 0;
+        uint32_t badValue = 0;
+        bool valid = false;
+        size_t counterOffset = dtacqSpadOffset(layout, 0);
+        int nBad = dtacqCheckSampleCounts(&frame.raw[0], nRows, rowBytes, counterOffset,
+                                          &next, &valid, &badExpected, &badValue);
+        testOk(nBad == 0 && valid && next == (epicsUInt32)(frame.firstCount + nRows),
+               "%s: sample counter continuous across the wrap", name);
+
+        epicsUInt32 corrupt = frame.firstCount + (epicsUInt32)row + 7;
+        memcpy(&frame.raw[row * rowBytes + counterOffset], &corrupt, sizeof(corrupt));
+        valid = false;
+        nBad = dtacqCheckSampleCounts(&frame.raw[0], nRows, rowBytes, counterOffset,
+                                      &next, &valid, &badExpected, &badValue);
+        testOk(nBad == 1 && badExpected == (epicsUInt32)(frame.firstCount + row) && badValue == corrupt,
+               "%s: skipped count found at row %d", name, row);
+        epicsUInt32 good = frame.firstCount + (epicsUInt32)row;
+        memcpy(&frame.raw[row * rowBytes + counterOffset], &good, sizeof(good));
+    } else {
+        testSkip(2, "no sample counter in this layout");
+    }
+
+    if (wordBytes == 4) {
+        std::vector<epicsInt32> masked((const epicsInt32 *)&frame.raw[0],
+                                       (const epicsInt32 *)&frame.raw[0] + (size_t)nRows * frame.rowWidth);
+        dtacqMaskData(&masked[0], nRows, frame.rowWidth, nChannels, DTACQ_TEST_MASK32);
+        bool ok = true;
+        for (int r = 0; r < nRows && ok; r++)
+            for (int c = 0; c < frame.rowWidth && ok; c++) {
+                epicsInt32 word = dtacqTestWord<epicsInt32>(&frame, r, c);
+                ok = masked[(size_t)r * frame.rowWidth + c] == ((c < nChannels) ? (word & DTACQ_TEST_MASK32) : word);
+            }
+        testOk(ok, "%s: ID bytes masked from the data columns only", name);
+
+        std::vector<epicsInt32> signature(nChannels);
+        for (int c = 0; c < nChannels; c++) signature[c] = dtacqTestId(c);
+        const epicsInt32 *pData = (const epicsInt32 *)&frame.raw[0];
+        int clean = dtacqFindIdMismatch(pData, nRows, frame.rowWidth, nChannels, &signature[0]);
+        epicsUInt8 slipped = dtacqTestId(nChannels) + 1;
+        memcpy(&frame.raw[row * rowBytes + (nChannels - 1) * 4], &slipped, 1);
+        int found = dtacqFindIdMismatch(pData, nRows, frame.rowWidth, nChannels, &signature[0]);
+        testOk(clean == -1 && found == row, "%s: channel slip found at row %d", name, row);
+        epicsUInt8 id = dtacqTestId(nChannels - 1);
+        memcpy(&frame.raw[row * rowBytes + (nChannels - 1) * 4], &id, 1);
+    } else {
+        testSkip(2, "no ID bytes in 16 bit data");
+    }
+
+    /* The codec reproduces the frame with the bits below the ADC data cleared */
+    DtacqCodecFrame codec;
+    codec.pData = &frame.raw[0];
+    codec.elemSize = wordBytes;
+    codec.rowWidth = frame.rowWidth;
+    codec.nRows = nRows;
+    codec.nData = nChannels;
+    codec.dataShift = (wordBytes == 4) ? DTACQ_TEST_SHIFT32 : 0;
+    std::vector<uint8_t> compressed, scratch;
+    dtacqTestCompress(&codec, &compressed, &scratch);
+    std::vector<epicsUInt8> decoded(frame.raw.size());
+    long n = dtacqDecompress(&compressed[0], compressed.size(), &decoded[0], decoded.size());
+    std::vector<epicsUInt8> expected(frame.raw);
+    if (wordBytes == 4)
+        dtacqMaskData((epicsInt32 *)&expected[0], nRows, frame.rowWidth, nChannels, DTACQ_TEST_MASK32);
+    testOk(n == (long)expected.size() && decoded == expected,
+           "%s: compressed frame decodes bit exactly (%lu -> %lu bytes)", name,
+           (unsigned long)expected.size(), (unsigned long)compressed.size());
+}
+
+static void testOther()
+{
+    testOk(dtacqCountToVolts(10.0, 16) == 20.0 / 65536.0, "16 bit +/-10 V count to volts");
+    testOk(dtacqCountToVolts(2.5, 24) == 5.0 / 16777216.0, "24 bit +/-2.5 V count to volts");
+
+    DtacqFrameLayout layout;
+    dtacqSetLayout(&layout, 4, 8, 12, 1);
+    testOk(layout.spadWords == DTACQ_MAX_SPAD_WORDS && layout.dix == 1, "scratchpad size clamped to %d words",
+           DTACQ_MAX_SPAD_WORDS);
+    dtacqSetLayout(&layout, 2, 8, 0, 1);
+    testOk(layout.dix == 0 && dtacqRowWidth(&layout) == 8, "DIX ignored without a scratchpad");
+
+    testOk(dtacqToVolts<epicsInt32>::select(2 * DTACQ_MAX_SPAD_WORDS + 1) == dtacqRawToVolts<epicsInt32>,
+           "generic conversion used beyond the specialised scratchpad sizes");
+
+    /* LZ4 on its own: incompressible, highly repetitive and tiny inputs */
+    bool ok = true;
+    epicsUInt32 state = 99;
+    for (int n = 1; n < 5000 && ok; n = n * 3 + 1) {
+        for (int kind = 0; kind < 2 && ok; kind++) {
+            std::vector<uint8_t> in(n), packed(n + n / 255 + 16), out(n);
+            for (int i = 0; i < n; i++) in[i] = kind ? (uint8_t)(i % 5) : (uint8_t)dtacqTestRandom(&state);
+            int size = dtacqLz4Compress(&in[0], n, &packed[0], (int)packed.size());
+            ok = size > 0 && dtacqLz4Decompress(&packed[0], size, &out[0], n) == n && in == out;
+        }
+    }
+    testOk(ok, "LZ4 blocks round trip");
+}
+
+MAIN(testDtacqKernels)
+{
+    int nFrames = 0;
+    for (int s = 0; s < NELEMENTS(spadSizes); s++) nFrames += spadSizes[s] ? 2 : 1;
+    nFrames *= NELEMENTS(wordSizes) * NELEMENTS(channelCounts);
+    testPlan(nFrames * TESTS_PER_FRAME + OTHER_TESTS);
+
+    for (int w = 0; w < NELEMENTS(wordSizes); w++)
+        for (int c = 0; c < NELEMENTS(channelCounts); c++)
+            for (int s = 0; s < NELEMENTS(spadSizes); s++)
+                for (int dix = 0; dix <= (spadSizes[s] ? 1 : 0); dix++)
+                    testFrame(wordSizes[w], channelCounts[c], spadSizes[s], dix);
+    testOther();
+    return testDone();
+}